@@ -2,79 +2,745 @@
 
 #include "adc.h"
 #include "load.h"
+#include "settings.h"
+#include <stdbool.h>
 #include "config.h"
 #include "inc/stm8s_itc.h"
 #include <stdio.h>
 
-static uint16_t adc_sum[ADC_NUM_CHANNELS];
+#ifdef ADC_BENCH
+/* bench_adc.c enters the IRQ with the TRAP instruction. */
+#define ADC_IRQ __trap
+#else
+#define ADC_IRQ __interrupt(ITC_IRQ_ADC1)
+#endif
+
+/* Ping-pong accumulation buffers: adc_irq() sums into adc_sum[adc_buf] while
+   adc_timer() evaluates the other buffer. Swapping is a single byte write and
+   therefore atomic, so the ADC never has to be stopped. */
+static uint32_t adc_sum[2][ADC_NUM_CHANNELS];
+static uint16_t adc_count[2];       // Scans, ADC_CH_LOAD is part of every scan
+static uint16_t adc_count_sense[2]; // Scans that included ADC_CH_SENSE
+static uint16_t adc_count_slow[2];  // Scans that included the housekeeping channels
+static volatile uint8_t adc_buf = 0;
+
+/* Channel scheduler: Scan mode always converts channel 0 up to the selected
+   channel, so the last channel of a scan decides what is converted. Fast scans
+   stop after ADC_CH_LOAD, or after ADC_CH_SENSE while remote sense is in use.
+   Every ADC_SLOW_INTERVAL-th scan is a slow scan up to ADC_CH_12V, which
+   also converts v_sense for the remote sense detection. Temperature (channel
+   0) is part of every scan but is only summed in the slow scans, like 12V.
+   Each ADC_FAST_DIVIDER window contains the same number of slow scans.
+   adc_irq() reads the last channel of the finished scan from CSR before
+   scheduling the next one. */
+#define ADC_SCAN_LOAD  (ADC_CH_LOAD | ADC1_IT_EOCIE | ADC1_IT_AWDIE)
+#define ADC_SCAN_SENSE (ADC_CH_SENSE | ADC1_IT_EOCIE | ADC1_IT_AWDIE)
+#define ADC_SCAN_SLOW  (ADC_CH_12V | ADC1_IT_EOCIE | ADC1_IT_AWDIE)
+#if (1 << ADC_FAST_SHIFT) != ADC_FAST_DIVIDER || ADC_FAST_SHIFT > 6
+    #error "ADC_FAST_DIVIDER must be 2^ADC_FAST_SHIFT and at most 64"
+#endif
+#if (ADC_SLOW_INTERVAL & (ADC_SLOW_INTERVAL - 1)) || ADC_SLOW_INTERVAL > ADC_FAST_DIVIDER
+    #error "ADC_SLOW_INTERVAL must be a power of 2 and at most ADC_FAST_DIVIDER"
+#endif
+static uint8_t adc_scan_index = 0;
+static uint8_t adc_scan_fast = ADC_SCAN_LOAD; // CSR value for fast scans
+
+/* Outlier rejection: adc_irq() clamps every sample to a window around the
+   previous systick's average, so single spikes (e.g. from switching power
+   supplies) can only pull the average by the window size. This costs the same
+   for every channel and sample. Channels without the filter enabled in
+   settings.outlier_filter get a window covering the whole range. If the
+   average moved by more than half the window it is opened for one systick so
+   real steps are followed immediately. */
+static uint16_t adc_clamp_lo[ADC_NUM_CHANNELS];
+static uint16_t adc_clamp_hi[ADC_NUM_CHANNELS] = {0x3ff, 0x3ff, 0x3ff, 0x3ff};
+static uint16_t adc_clamp_last[ADC_NUM_CHANNELS];
+
+/* Burst timing: TIM4 counts microseconds (see systick_init()). adc_irq()
+   timestamps the start (ADON) and the end (EOC) of every scan. All differences
+   are 8 bit, which is enough for scans of ~25 us but aliases if the IRQ is
+   blocked for more than 255 us. Min/max are kept until adc_timing_reset(),
+   the means are updated every systick by adc_timer(). */
+static uint8_t adc_burst_start;
+static uint16_t adc_burst_sum[2];
+uint8_t adc_burst_min, adc_burst_max;
+uint8_t adc_period_min, adc_period_max;
+uint16_t adc_burst_mean, adc_period_mean;
+
+/* Analog watchdog window for ADC_CH_LOAD in raw 10 bit counts (inverse of the
+   calibration in adc_update()). Leaving it switches the load off directly in
+   adc_irq() instead of waiting for the next systick. Only the load terminals
+   are guarded as the watchdog has a single window for all channels.
+   v_sense is still checked in adc_update(). */
+#define ADC_AWD_LOW  (ADC_LOAD_MIN >> 6)
+static uint16_t adc_awd_high = 0x3ff; // Set from calibration in adc_cal_apply()
+
+/* Calibration: ADC_CAL_POINTS breakpoints per channel, sorted by raw value.
+   The table is stored in EEPROM. adc_cal is edited over UART, adc_cal_apply()
+   only copies it to adc_cal_live once it is valid. The slopes of the segments
+   between the breakpoints are precomputed at the same time so adc_cal_eval()
+   needs no division and never sees a half edited table. */
+adc_cal_point_t adc_cal[ADC_NUM_CHANNELS][ADC_CAL_POINTS];
+static adc_cal_point_t adc_cal_live[ADC_NUM_CHANNELS][ADC_CAL_POINTS];
+typedef struct {
+    uint16_t slope; // value per raw count, 16 fractional bits
+    bool negative;  // value decreases with raw value (temperature)
+} adc_cal_segment_t;
+static adc_cal_segment_t adc_cal_segments[ADC_NUM_CHANNELS][ADC_CAL_POINTS - 1];
+_Static_assert(sizeof(adc_cal) < EEPROM_ADC_CAL_SIZE, "ADC calibration doesn't fit into EEPROM");
 uint16_t adc_values[ADC_NUM_CHANNELS];
-static uint8_t adc_count = 0;
+uint16_t adc_display[ADC_NUM_CHANNELS];
+
+/* Decimation filter: The per systick average (= first CIC stage) of each
+   channel is passed through a configurable number of cascaded moving averages
+   over 2^shift systicks. Each stage costs one addition and one subtraction
+   regardless of its length. The stages only reduce the noise, not the lag, so
+   control and protection use the unfiltered average (adc_values) and the
+   filter only feeds the display and telemetry (adc_display). */
+#if ADC_FILTER_TEMP_ORDER > ADC_FILTER_ORDER_MAX || ADC_FILTER_LOAD_ORDER > ADC_FILTER_ORDER_MAX || \
+    ADC_FILTER_SENSE_ORDER > ADC_FILTER_ORDER_MAX || ADC_FILTER_12V_ORDER > ADC_FILTER_ORDER_MAX || \
+    ADC_FILTER_TEMP_SHIFT > ADC_FILTER_SHIFT_MAX || ADC_FILTER_LOAD_SHIFT > ADC_FILTER_SHIFT_MAX || \
+    ADC_FILTER_SENSE_SHIFT > ADC_FILTER_SHIFT_MAX || ADC_FILTER_12V_SHIFT > ADC_FILTER_SHIFT_MAX
+    #error "ADC filter order or shift too large"
+#endif
+typedef struct {
+    uint32_t sum;
+    uint16_t history[1 << ADC_FILTER_SHIFT_MAX];
+} adc_filter_stage_t;
+static adc_filter_stage_t adc_filter[ADC_NUM_CHANNELS][ADC_FILTER_ORDER_MAX];
+static uint8_t adc_filter_index = 0;
+static bool adc_filter_valid = 0;
+static uint16_t adc_filtered[ADC_NUM_CHANNELS];
+static const uint8_t adc_filter_order[ADC_NUM_CHANNELS] = {
+    [ADC_CH_TEMPERATURE] = ADC_FILTER_TEMP_ORDER,
+    [ADC_CH_LOAD]        = ADC_FILTER_LOAD_ORDER,
+    [ADC_CH_SENSE]       = ADC_FILTER_SENSE_ORDER,
+    [ADC_CH_12V]         = ADC_FILTER_12V_ORDER,
+};
+static const uint8_t adc_filter_shift[ADC_NUM_CHANNELS] = {
+    [ADC_CH_TEMPERATURE] = ADC_FILTER_TEMP_SHIFT,
+    [ADC_CH_LOAD]        = ADC_FILTER_LOAD_SHIFT,
+    [ADC_CH_SENSE]       = ADC_FILTER_SENSE_SHIFT,
+    [ADC_CH_12V]         = ADC_FILTER_12V_SHIFT,
+};
 uint16_t temperature;
 uint16_t v_12V;
 uint16_t v_load;
 uint16_t v_sense;
+uint16_t v_lead;
+bool adc_remote_sense = 0;
 
 void adc_init()
 {
-    /* 1 conversion takes 14 ADC cycles. 4 channels are processed in scan mode.
-       => 56 ADC cycles per scan.
-    divider    sample rate      cpu cycles between irqs
-    3            95 kHz         168
-    4            71 kHz         224
-    6            48 kHz         336
-    8            36 kHz         448
+    /* 1 conversion takes 14 ADC cycles. Fast scans process 2 channels
+       => 28 ADC cycles per scan (42 with remote sense, 56 for slow scans).
+    divider    sample rate      cpu cycles between irqs (2 / 3 channels)
+    3           127 kHz          84 / 126
+    4            95 kHz         112 / 168
+    6            63 kHz         168 / 252
+    8            48 kHz         224 / 336
     IRQ overhead is 18 cycles (PM0044, page 14).
+    The next scan is started from the IRQ, so there is no dead time between
+    systicks. One slow scan every ADC_SLOW_INTERVAL (16) makes a scan 29.75
+    ADC cycles on average (42.9 with remote sense) => ~670 scans of the
+    voltage channels (~465 with remote sense, 714 / 476 without slow scans)
+    and ~42 (~29) of the housekeeping channels per systick. A slow scan's IRQ
+    sums two more channels, ~26 cycles or ~2 cycles per scan on average.
     */
-    adc_count = 0;
+    adc_buf = 0;
+    adc_count[0] = 0;
+    adc_count[1] = 0;
+    adc_count_sense[0] = 0;
+    adc_count_sense[1] = 0;
+    adc_count_slow[0] = 0;
+    adc_count_slow[1] = 0;
+    adc_scan_index = 0;
+    adc_scan_fast = ADC_SCAN_LOAD;
+    adc_burst_sum[0] = 0;
+    adc_burst_sum[1] = 0;
+    adc_timing_reset();
     ADC1->CR1 = ADC1_PRESSEL_FCPU_D8 | ADC1_CONVERSIONMODE_SINGLE;
     ADC1->CR2 = ADC1_ALIGN_RIGHT | ADC1_CR2_SCAN;
     ADC1->TDRH = 0;
-    ADC1->TDRL = (1<<ADC_CH_TEMPERATURE) | (1<<ADC_CH_SENSE) | (1<<ADC_CH_SENSE) | (1<<ADC_CH_12V);
-    ADC1->CSR = (ADC_NUM_CHANNELS - 1) | ADC1_IT_EOCIE;
+    ADC1->TDRL = (1<<ADC_CH_TEMPERATURE) | (1<<ADC_CH_LOAD) | (1<<ADC_CH_SENSE) | (1<<ADC_CH_12V);
+    adc_cal_init(); // Also sets the high watchdog threshold
+    ADC1->LTRH = ADC_AWD_LOW >> 2;
+    ADC1->LTRL = ADC_AWD_LOW & 3;
+    ADC1->AWCRH = 0;
+    ADC1->AWCRL = 1<<ADC_CH_LOAD;
+    ADC1->CSR = ADC_SCAN_SLOW;
     ADC1->CR1 |= ADC1_CR1_ADON; //Wake up
+    adc_burst_start = TIM4->CNTR;
     ADC1->CR1 |= ADC1_CR1_ADON; //Start converting
 }
 
-void adc_irq() __interrupt(ITC_IRQ_ADC1)
+/* Called from adc_irq() when the analog watchdog fired. The load has already
+   been switched off at this point, only latch the error. */
+void adc_awd_trip()
+{
+    uint16_t value = ADC1->DB1RH << 8;
+    value |= ADC1->DB1RL;
+    if (value > adc_awd_high) {
+        error = ERROR_OVERVOLTAGE;
+    } else {
+        error = ERROR_POLARITY;
+    }
+    ADC1->AWSRL = 0;
+    // AWD flag is cleared with EOC when the next scan is scheduled
+}
+
+/* Fast control path: Called from adc_irq() every ADC_FAST_DIVIDER scans
+   (~2.1 kHz, ~1.45 kHz with remote sense) after the next scan was started.
+   The voltages are averaged over the scans since the last call, without the
+   decimation filter, and passed to load_fast_update(). The average always
+   covers ADC_FAST_DIVIDER scans, so it is a shift. adc_timer() switching
+   buffers restarts the average, the first shorter interval after it is left
+   to the systick (load_update()). */
+static uint32_t adc_fast_sum[2]; // adc_sum of load and sense at the last call
+static uint16_t adc_fast_count, adc_fast_count_sense;
+static uint8_t adc_fast_buf;
+static uint16_t adc_cal_eval(uint8_t ch, uint16_t raw);
+
+void adc_fast_irq()
 {
-    //TODO: Optimize this function in asm
-    // with 32 bit buffers and double buffering this function takes
-    //about >200 cycles.
+    uint8_t buf = adc_buf;
+    uint32_t *sum = adc_sum[buf];
+    uint16_t n, n_sense, d_load, d_sense, v_terminal, voltage;
 
-    //This solution takes ~16 cycles/addition
+    if (buf != adc_fast_buf) {
+        adc_fast_buf = buf;
+        adc_fast_sum[0] = 0;
+        adc_fast_sum[1] = 0;
+        adc_fast_count = 0;
+        adc_fast_count_sense = 0;
+    }
+    n = adc_count[buf] - adc_fast_count;
+    n_sense = adc_count_sense[buf] - adc_fast_count_sense;
+    // ADC_FAST_DIVIDER 10 bit samples fit into 16 bits
+    d_load = sum[ADC_CH_LOAD] - adc_fast_sum[0];
+    d_sense = sum[ADC_CH_SENSE] - adc_fast_sum[1];
+    adc_fast_sum[0] = sum[ADC_CH_LOAD];
+    adc_fast_sum[1] = sum[ADC_CH_SENSE];
+    adc_fast_count = adc_count[buf];
+    adc_fast_count_sense = adc_count_sense[buf];
+    if (n != ADC_FAST_DIVIDER) return;
+    v_terminal = adc_cal_eval(ADC_CH_LOAD, d_load << (6 - ADC_FAST_SHIFT));
+    voltage = v_terminal;
+    if (adc_remote_sense) {
+        if (n_sense != ADC_FAST_DIVIDER) return;
+        voltage = adc_cal_eval(ADC_CH_SENSE, d_sense << (6 - ADC_FAST_SHIFT));
+    }
+    load_fast_update(voltage, v_terminal);
+}
+
+#if ADC_IRQ_ASM
+#if ADC_CH_TEMPERATURE != 0 || ADC_CH_LOAD != 1 || ADC_CH_SENSE != 2 || ADC_CH_12V != 3
+#error "asm version of adc_irq() is unrolled for the default channel order"
+#endif
+#if PINE_ENABLE != (1u<<5)
+#error "asm version of adc_irq() expects the enable signal on PE5"
+#endif
+/* Hand optimized version of the C code below. All addresses are constant so
+   each channel is a clamp and a 16 bit add to the low word of the sum plus a
+   rarely taken carry into the high word (~13 cycles/channel).
+   Use "make bench-adc" to compare both versions. */
+void adc_irq() ADC_IRQ __naked
+{
+    __asm
+    ; Analog watchdog: switch off load (GPIOE->ODR |= PINE_ENABLE) and latch error
+    btjf    ADC1_BaseAddress+0x20, #6, 00001$   ; CSR.AWD
+    bset    GPIOE_BaseAddress, #5
+    call    _adc_awd_trip
+00001$:
+    ; Burst end: duration = TIM4->CNTR - adc_burst_start (us, modulo 256)
+    ld      a, TIM4_BaseAddress+4   ; CNTR
+    sub     a, _adc_burst_start
+    cp      a, _adc_burst_max
+    jrule   00030$
+    ld      _adc_burst_max, a
+00030$:
+    cp      a, _adc_burst_min
+    jruge   00031$
+    ld      _adc_burst_min, a
+00031$:
+    clrw    y
+    ld      yl, a
+    ld      a, _adc_buf
+    jrne    00002$
+    ; adc_burst_sum[0] += duration
+    addw    y, _adc_burst_sum+0
+    ldw     _adc_burst_sum+0, y
+    ; adc_count[0]++, adc_sum[0][ADC_CH_LOAD] += clamped DB1R
+    ldw     x, _adc_count+0
+    incw    x
+    ldw     _adc_count+0, x
+    ldw     x, ADC1_BaseAddress+2   ; DB1R
+    cpw     x, _adc_clamp_lo+2
+    jrnc    00102$
+    ldw     x, _adc_clamp_lo+2
+00102$:
+    cpw     x, _adc_clamp_hi+2
+    jrule   00103$
+    ldw     x, _adc_clamp_hi+2
+00103$:
+    addw    x, _adc_sum+6
+    ldw     _adc_sum+6, x
+    jrnc    00011$
+    ldw     x, _adc_sum+4
+    incw    x
+    ldw     _adc_sum+4, x
+00011$:
+    ; Last channel of the finished scan decides which other channels to sum
+    ld      a, ADC1_BaseAddress+0x20 ; CSR
+    and     a, #0x0f
+    cp      a, #ADC_CH_SENSE
+    jrult   00004$
+    ; adc_count_sense[0]++, same for ADC_CH_SENSE
+    ldw     x, _adc_count_sense+0
+    incw    x
+    ldw     _adc_count_sense+0, x
+    ldw     x, ADC1_BaseAddress+4   ; DB2R
+    cpw     x, _adc_clamp_lo+4
+    jrnc    00104$
+    ldw     x, _adc_clamp_lo+4
+00104$:
+    cpw     x, _adc_clamp_hi+4
+    jrule   00105$
+    ldw     x, _adc_clamp_hi+4
+00105$:
+    addw    x, _adc_sum+10
+    ldw     _adc_sum+10, x
+    jrnc    00012$
+    ldw     x, _adc_sum+8
+    incw    x
+    ldw     _adc_sum+8, x
+00012$:
+    cp      a, #ADC_CH_12V
+    jrult   00004$
+    ; adc_count_slow[0]++, same for the housekeeping channels
+    ldw     x, _adc_count_slow+0
+    incw    x
+    ldw     _adc_count_slow+0, x
+    ldw     x, ADC1_BaseAddress+0   ; DB0R
+    cpw     x, _adc_clamp_lo+0
+    jrnc    00100$
+    ldw     x, _adc_clamp_lo+0
+00100$:
+    cpw     x, _adc_clamp_hi+0
+    jrule   00101$
+    ldw     x, _adc_clamp_hi+0
+00101$:
+    addw    x, _adc_sum+2
+    ldw     _adc_sum+2, x
+    jrnc    00010$
+    ldw     x, _adc_sum+0
+    incw    x
+    ldw     _adc_sum+0, x
+00010$:
+    ldw     x, ADC1_BaseAddress+6   ; DB3R
+    cpw     x, _adc_clamp_lo+6
+    jrnc    00106$
+    ldw     x, _adc_clamp_lo+6
+00106$:
+    cpw     x, _adc_clamp_hi+6
+    jrule   00107$
+    ldw     x, _adc_clamp_hi+6
+00107$:
+    addw    x, _adc_sum+14
+    ldw     _adc_sum+14, x
+    jrnc    00013$
+    ldw     x, _adc_sum+12
+    incw    x
+    ldw     _adc_sum+12, x
+00013$:
+    jra     00004$
+00002$:
+    ; adc_burst_sum[1] += duration
+    addw    y, _adc_burst_sum+2
+    ldw     _adc_burst_sum+2, y
+    ; adc_count[1]++, adc_sum[1][ADC_CH_LOAD] += clamped DB1R
+    ldw     x, _adc_count+2
+    incw    x
+    ldw     _adc_count+2, x
+    ldw     x, ADC1_BaseAddress+2   ; DB1R
+    cpw     x, _adc_clamp_lo+2
+    jrnc    00122$
+    ldw     x, _adc_clamp_lo+2
+00122$:
+    cpw     x, _adc_clamp_hi+2
+    jrule   00123$
+    ldw     x, _adc_clamp_hi+2
+00123$:
+    addw    x, _adc_sum+22
+    ldw     _adc_sum+22, x
+    jrnc    00021$
+    ldw     x, _adc_sum+20
+    incw    x
+    ldw     _adc_sum+20, x
+00021$:
+    ; Last channel of the finished scan decides which other channels to sum
+    ld      a, ADC1_BaseAddress+0x20 ; CSR
+    and     a, #0x0f
+    cp      a, #ADC_CH_SENSE
+    jrult   00004$
+    ; adc_count_sense[1]++, same for ADC_CH_SENSE
+    ldw     x, _adc_count_sense+2
+    incw    x
+    ldw     _adc_count_sense+2, x
+    ldw     x, ADC1_BaseAddress+4   ; DB2R
+    cpw     x, _adc_clamp_lo+4
+    jrnc    00124$
+    ldw     x, _adc_clamp_lo+4
+00124$:
+    cpw     x, _adc_clamp_hi+4
+    jrule   00125$
+    ldw     x, _adc_clamp_hi+4
+00125$:
+    addw    x, _adc_sum+26
+    ldw     _adc_sum+26, x
+    jrnc    00022$
+    ldw     x, _adc_sum+24
+    incw    x
+    ldw     _adc_sum+24, x
+00022$:
+    cp      a, #ADC_CH_12V
+    jrult   00004$
+    ; adc_count_slow[1]++, same for the housekeeping channels
+    ldw     x, _adc_count_slow+2
+    incw    x
+    ldw     _adc_count_slow+2, x
+    ldw     x, ADC1_BaseAddress+0   ; DB0R
+    cpw     x, _adc_clamp_lo+0
+    jrnc    00120$
+    ldw     x, _adc_clamp_lo+0
+00120$:
+    cpw     x, _adc_clamp_hi+0
+    jrule   00121$
+    ldw     x, _adc_clamp_hi+0
+00121$:
+    addw    x, _adc_sum+18
+    ldw     _adc_sum+18, x
+    jrnc    00020$
+    ldw     x, _adc_sum+16
+    incw    x
+    ldw     _adc_sum+16, x
+00020$:
+    ldw     x, ADC1_BaseAddress+6   ; DB3R
+    cpw     x, _adc_clamp_lo+6
+    jrnc    00126$
+    ldw     x, _adc_clamp_lo+6
+00126$:
+    cpw     x, _adc_clamp_hi+6
+    jrule   00127$
+    ldw     x, _adc_clamp_hi+6
+00127$:
+    addw    x, _adc_sum+30
+    ldw     _adc_sum+30, x
+    jrnc    00023$
+    ldw     x, _adc_sum+28
+    incw    x
+    ldw     _adc_sum+28, x
+00023$:
+00004$:
+    ; Schedule next scan: slow scan every ADC_SLOW_INTERVAL scans, else adc_scan_fast
+    inc     _adc_scan_index
+    ld      a, _adc_scan_index
+    and     a, #ADC_SLOW_INTERVAL-1
+    jrne    00006$
+    ld      a, #ADC_CH_12V|0x30     ; last channel | ADC1_IT_EOCIE | ADC1_IT_AWDIE
+    jra     00005$
+00006$:
+    ld      a, _adc_scan_fast
+00005$:
+    ld      ADC1_BaseAddress+0x20, a ; CSR, also clears EOC and AWD
+    ; Burst start: period = TIM4->CNTR - previous adc_burst_start
+    ld      a, TIM4_BaseAddress+4   ; CNTR
+    ld      xl, a
+    sub     a, _adc_burst_start
+    cp      a, _adc_period_max
+    jrule   00032$
+    ld      _adc_period_max, a
+00032$:
+    cp      a, _adc_period_min
+    jruge   00033$
+    ld      _adc_period_min, a
+00033$:
+    ld      a, xl
+    ld      _adc_burst_start, a
+    ; Start next scan: CR1 |= ADC1_CR1_ADON
+    bset    ADC1_BaseAddress+0x21, #0
+    ; Fast control path every ADC_FAST_DIVIDER scans
+    ld      a, _adc_scan_index
+    and     a, #ADC_FAST_DIVIDER-1
+    jrne    00007$
+    call    _adc_fast_irq
+00007$:
+    iret
+    __endasm;
+}
+#else
+static inline uint16_t adc_clamp(uint8_t ch, uint16_t value)
+{
+    if (value < adc_clamp_lo[ch]) return adc_clamp_lo[ch];
+    if (value > adc_clamp_hi[ch]) return adc_clamp_hi[ch];
+    return value;
+}
+
+void adc_irq() ADC_IRQ
+{
+    if (ADC1->CSR & ADC1_CSR_AWD) {
+        GPIOE->ODR |= PINE_ENABLE;
+        adc_awd_trip();
+    }
+    uint8_t t = TIM4->CNTR - adc_burst_start;
+    if (t > adc_burst_max) adc_burst_max = t;
+    if (t < adc_burst_min) adc_burst_min = t;
     // uint16_t *r = (uint16_t *)&ADC1->DB0RH; => Internal Error (SDCC)
+    uint8_t buf = adc_buf;
     uint8_t *p = &ADC1->DB0RH;
     uint16_t *r = p;
-    uint16_t *w = &adc_sum[0];
-    *w++ += *r++;
-    *w++ += *r++;
-    *w++ += *r++;
-    *w++ += *r++;
-    //Clear IRQ flag
-    ADC1->CSR = (ADC_NUM_CHANNELS - 1) | ADC1_IT_EOCIE;
+    uint32_t *w = adc_sum[buf];
+    uint8_t last = ADC1->CSR & ADC1_CSR_CH;
+    w[ADC_CH_LOAD] += adc_clamp(ADC_CH_LOAD, r[ADC_CH_LOAD]);
+    adc_count[buf]++;
+    adc_burst_sum[buf] += t;
+    if (last >= ADC_CH_SENSE) {
+        w[ADC_CH_SENSE] += adc_clamp(ADC_CH_SENSE, r[ADC_CH_SENSE]);
+        adc_count_sense[buf]++;
+    }
+    if (last >= ADC_CH_12V) {
+        w[ADC_CH_TEMPERATURE] += adc_clamp(ADC_CH_TEMPERATURE, r[ADC_CH_TEMPERATURE]);
+        w[ADC_CH_12V] += adc_clamp(ADC_CH_12V, r[ADC_CH_12V]);
+        adc_count_slow[buf]++;
+    }
+    //Schedule next scan and clear IRQ flag
+    adc_scan_index++;
+    if ((adc_scan_index & (ADC_SLOW_INTERVAL - 1)) == 0) {
+        ADC1->CSR = ADC_SCAN_SLOW;
+    } else {
+        ADC1->CSR = adc_scan_fast;
+    }
+    t = TIM4->CNTR;
+    uint8_t period = t - adc_burst_start;
+    if (period > adc_period_max) adc_period_max = period;
+    if (period < adc_period_min) adc_period_min = period;
+    adc_burst_start = t;
+    //Start next scan
+    ADC1->CR1 |= ADC1_CR1_ADON;
+    if ((adc_scan_index & (ADC_FAST_DIVIDER - 1)) == 0) {
+        adc_fast_irq();
+    }
+}
+#endif
 
-    if (++adc_count < ADC_SAMPLES_PER_MEASUREMENT) {
-        ADC1->CR1 |= ADC1_CR1_ADON;
+/* Set the clamp window for the next systick. */
+static void adc_clamp_update(uint8_t ch, uint16_t value)
+{
+    uint16_t center = value >> 6; // 10 bit like the raw samples
+    uint16_t last = adc_clamp_last[ch];
+    uint16_t lo = 0, hi = 0x3ff;
+    adc_clamp_last[ch] = center;
+    if ((settings.outlier_filter & (1 << ch)) &&
+        center < last + ADC_OUTLIER_WINDOW / 2 && last < center + ADC_OUTLIER_WINDOW / 2) {
+        lo = center > ADC_OUTLIER_WINDOW ? center - ADC_OUTLIER_WINDOW : 0;
+        hi = center < 0x3ff - ADC_OUTLIER_WINDOW ? center + ADC_OUTLIER_WINDOW : 0x3ff;
     }
+    // Each access is atomic, a window that is briefly inconsistent does no harm.
+    adc_clamp_lo[ch] = lo;
+    adc_clamp_hi[ch] = hi;
 }
 
-void adc_update()
+/* Run one new measurement through the channel's filter stages. */
+static uint16_t adc_filter_update(uint8_t ch, uint16_t value)
 {
-    temperature = (ADC_CAL_TEMP_T - adc_values[ADC_CH_TEMPERATURE]) / ADC_CAL_TEMP_M;
-    v_12V = (uint32_t)adc_values[ADC_CH_12V] * ADC_CAL_12V >> 16;
+    uint8_t shift = adc_filter_shift[ch];
+    uint8_t i = adc_filter_index & ((1 << shift) - 1);
+    adc_filter_stage_t *stage = adc_filter[ch];
+    for (uint8_t n = adc_filter_order[ch]; n; n--, stage++) {
+        if (!adc_filter_valid) {
+            // Start with settled filters instead of ramping up from 0
+            stage->sum = (uint32_t)value << shift;
+            for (uint8_t j = 0; j < (1 << shift); j++) {
+                stage->history[j] = value;
+            }
+        }
+        stage->sum += value;
+        stage->sum -= stage->history[i];
+        stage->history[i] = value;
+        value = stage->sum >> shift;
+    }
+    return value;
+}
 
-    int32_t tmps;
-    uint32_t tmpu;
+/* Default calibration from the linear factors in config.h */
+static uint16_t adc_cal_linear(uint8_t ch, uint16_t raw)
+{
+    switch (ch) {
+        case ADC_CH_TEMPERATURE:
+            return (ADC_CAL_TEMP_T - raw) / ADC_CAL_TEMP_M;
+        case ADC_CH_LOAD:
+            return (uint32_t)(raw - ADC_CAL_LOAD_T) * ADC_CAL_LOAD_M >> 16;
+        case ADC_CH_SENSE:
+            return (uint32_t)(raw - ADC_CAL_SENSE_T) * ADC_CAL_SENSE_M >> 16;
+        default: // ADC_CH_12V
+            return (uint32_t)raw * ADC_CAL_12V >> 16;
+    }
+}
 
-    tmps = adc_values[ADC_CH_LOAD];
-    tmps -= ADC_CAL_LOAD_T;
-    tmpu = tmps > 0 ? tmps : 0;
-    v_load = tmpu * ADC_CAL_LOAD_M >> 16;
+static void adc_cal_default()
+{
+    /* Breakpoints are evenly spaced between the raw values of the lowest and
+       highest valid measurement. */
+    const uint16_t raw_min[ADC_NUM_CHANNELS] = {
+        [ADC_CH_TEMPERATURE] = 0,
+        [ADC_CH_LOAD]        = ADC_CAL_LOAD_T,
+        [ADC_CH_SENSE]       = ADC_CAL_SENSE_T,
+        [ADC_CH_12V]         = 0,
+    };
+    const uint16_t raw_max[ADC_NUM_CHANNELS] = {
+        [ADC_CH_TEMPERATURE] = ADC_CAL_TEMP_T,
+        [ADC_CH_LOAD]        = 0xffff,
+        [ADC_CH_SENSE]       = 0xffff,
+        [ADC_CH_12V]         = 0xffff,
+    };
+    for (uint8_t ch = 0; ch < ADC_NUM_CHANNELS; ch++) {
+        for (uint8_t i = 0; i < ADC_CAL_POINTS; i++) {
+            uint16_t raw = raw_min[ch] + (uint32_t)(raw_max[ch] - raw_min[ch]) * i / (ADC_CAL_POINTS - 1);
+            adc_cal[ch][i].raw = raw;
+            adc_cal[ch][i].value = adc_cal_linear(ch, raw);
+        }
+    }
+}
 
-    tmps = adc_values[ADC_CH_SENSE];
-    tmps -= ADC_CAL_SENSE_T;
-    tmpu = tmps > 0 ? tmps : 0;
-    v_sense = tmpu * ADC_CAL_SENSE_M >> 16;
+/* Raw value at which ADC_CH_LOAD reaches the given voltage. */
+static uint16_t adc_cal_inverse_load(uint16_t value)
+{
+    const adc_cal_point_t *p = adc_cal_live[ADC_CH_LOAD];
+    const adc_cal_segment_t *seg = adc_cal_segments[ADC_CH_LOAD];
+    if (value <= p[0].value) return p[0].raw;
+    uint8_t i = 0;
+    while (i < ADC_CAL_POINTS - 2 && value >= p[i+1].value) i++;
+    if (seg[i].negative || !seg[i].slope) return 0xffff;
+    uint32_t raw = p[i].raw + ((uint32_t)(value - p[i].value) << 16) / seg[i].slope;
+    return raw > 0xffff ? 0xffff : raw;
+}
+
+/* running: The ADC IRQ is active, swap the tables with interrupts disabled.
+   At init time the interrupts are not enabled yet and must stay off. */
+static bool adc_cal_set(bool running)
+{
+    adc_cal_segment_t segments[ADC_NUM_CHANNELS][ADC_CAL_POINTS - 1];
+    for (uint8_t ch = 0; ch < ADC_NUM_CHANNELS; ch++) {
+        const adc_cal_point_t *p = adc_cal[ch];
+        adc_cal_segment_t *seg = segments[ch];
+        for (uint8_t i = 0; i < ADC_CAL_POINTS - 1; i++, p++, seg++) {
+            uint32_t slope;
+            uint16_t dv;
+            if (p[1].raw <= p[0].raw) {
+                return 0; // Breakpoints must be sorted
+            }
+            seg->negative = p[1].value < p[0].value;
+            dv = seg->negative ? p[0].value - p[1].value : p[1].value - p[0].value;
+            slope = ((uint32_t)dv << 16) / (p[1].raw - p[0].raw);
+            if (slope > 0xffff) {
+                return 0; // More than one unit per raw count is not possible with this hardware
+            }
+            seg->slope = slope;
+        }
+    }
+    // adc_cal_eval() also runs in the ADC IRQ
+    if (running) disableInterrupts();
+    for (uint8_t ch = 0; ch < ADC_NUM_CHANNELS; ch++) {
+        for (uint8_t i = 0; i < ADC_CAL_POINTS; i++) {
+            adc_cal_live[ch][i].raw = adc_cal[ch][i].raw;
+            adc_cal_live[ch][i].value = adc_cal[ch][i].value;
+            if (i < ADC_CAL_POINTS - 1) {
+                adc_cal_segments[ch][i].slope = segments[ch][i].slope;
+                adc_cal_segments[ch][i].negative = segments[ch][i].negative;
+            }
+        }
+    }
+    adc_awd_high = adc_cal_inverse_load(ADC_INPUT_MAX) >> 6;
+    ADC1->HTRH = adc_awd_high >> 2;
+    ADC1->HTRL = adc_awd_high & 3;
+    if (running) enableInterrupts();
+    return 1;
+}
+
+bool adc_cal_apply()
+{
+    return adc_cal_set(1);
+}
+
+void adc_cal_init()
+{
+    if (!eeprom_read_block(EEPROM_ADC_CAL, adc_cal, sizeof(adc_cal)) || !adc_cal_set(0)) {
+        adc_cal_default();
+        adc_cal_set(0);
+    }
+}
+
+void adc_cal_update()
+{
+    eeprom_write_block(EEPROM_ADC_CAL, adc_cal, sizeof(adc_cal));
+}
+
+/* Convert a raw value to mV or 0.1°C. Values below the first breakpoint are
+   clamped, values above the last one are extrapolated. */
+static uint16_t adc_cal_eval(uint8_t ch, uint16_t raw)
+{
+    const adc_cal_point_t *p = adc_cal_live[ch];
+    const adc_cal_segment_t *seg = adc_cal_segments[ch];
+    if (raw <= p[0].raw) return p[0].value;
+    uint8_t i = 0;
+    while (i < ADC_CAL_POINTS - 2 && raw >= p[i+1].raw) i++;
+    uint16_t delta = (uint32_t)(raw - p[i].raw) * seg[i].slope >> 16;
+    if (seg[i].negative) {
+        return p[i].value > delta ? p[i].value - delta : 0;
+    }
+    uint32_t result = (uint32_t)p[i].value + delta;
+    return result > 0xffff ? 0xffff : result;
+}
+
+/* Chooses between local and remote sensing. The hysteresis and the debounce
+   counter keep the displayed voltage from toggling between the two inputs. */
+static void adc_sense_update()
+{
+    static uint8_t debounce = 0;
+    bool remote;
+
+    if (settings.sense_mode == SENSE_LOCAL) {
+        remote = 0;
+    } else if (settings.sense_mode == SENSE_REMOTE) {
+        remote = 1;
+    } else if (v_sense < ADC_SENSE_DETECT_MIN) {
+        remote = 0;
+    } else if (adc_remote_sense) {
+        remote = v_sense >= v_load - (v_load >> ADC_SENSE_OFF_SHIFT);
+    } else {
+        remote = v_sense >= v_load - (v_load >> ADC_SENSE_ON_SHIFT);
+    }
+
+    if (remote == adc_remote_sense || settings.sense_mode != SENSE_AUTO ||
+        ++debounce >= ADC_SENSE_DEBOUNCE) {
+        adc_remote_sense = remote;
+        debounce = 0;
+    }
+
+    adc_scan_fast = adc_remote_sense ? ADC_SCAN_SENSE : ADC_SCAN_LOAD;
+
+    v_lead = 0;
+    if (adc_remote_sense && v_sense > v_load) {
+        v_lead = v_sense - v_load;
+    }
+}
+
+void adc_update()
+{
+    temperature = adc_cal_eval(ADC_CH_TEMPERATURE, adc_values[ADC_CH_TEMPERATURE]);
+    v_12V = adc_cal_eval(ADC_CH_12V, adc_values[ADC_CH_12V]);
+    v_load = adc_cal_eval(ADC_CH_LOAD, adc_values[ADC_CH_LOAD]);
+    v_sense = adc_cal_eval(ADC_CH_SENSE, adc_values[ADC_CH_SENSE]);
 
     if (v_12V < ADC_12V_MIN) {
         error = ERROR_POWER_SUPPLY;
@@ -88,26 +754,65 @@ void adc_update()
     if ((v_load > ADC_INPUT_MAX) || (v_sense > ADC_INPUT_MAX)) {
         error = ERROR_OVERVOLTAGE;
     }
+
+    adc_sense_update();
+
+    for (uint8_t i = 0; i < ADC_NUM_CHANNELS; i++) {
+        adc_display[i] = adc_cal_eval(i, adc_filtered[i]);
+    }
+}
+
+void adc_timing_reset()
+{
+    adc_burst_min = 0xff;
+    adc_burst_max = 0;
+    adc_period_min = 0xff;
+    adc_period_max = 0;
 }
 
 void adc_timer()
 {
-    if (adc_count != ADC_SAMPLES_PER_MEASUREMENT) {
+    uint8_t buf = adc_buf;
+    adc_buf = buf ^ 1; // From here on adc_irq() only touches the other buffer
+    uint16_t count = adc_count[buf];
+    uint16_t count_slow = adc_count_slow[buf];
+    if (count < ADC_SAMPLES_MIN || count_slow == 0) {
+        // ADC stopped or was starved by other interrupts
         error = ERROR_INTERNAL;
+    } else {
+        for (uint8_t i=0; i<ADC_NUM_CHANNELS; i++) {
+            // ADC is 10 bits => multiplying by 64 results in a left aligned 16 bit measurement.
+            uint16_t n = i == ADC_CH_LOAD ? count : i == ADC_CH_SENSE ? adc_count_sense[buf] : count_slow;
+            uint16_t value = (adc_sum[buf][i] << 6) / n;
+            adc_clamp_update(i, value);
+            adc_values[i] = value;
+            adc_filtered[i] = adc_filter_update(i, value);
+        }
+        adc_filter_index++;
+        if (!adc_filter_valid) {
+            adc_timing_reset(); // Drop startup scans, TIM4 wasn't running yet
+        }
+        adc_filter_valid = 1;
+        // Scans follow each other without gaps => mean period = systick / count
+        adc_burst_mean = (uint32_t)adc_burst_sum[buf] * 10 / count;
+        adc_period_mean = (10000000UL / F_SYSTICK) / count;
     }
     for (uint8_t i=0; i<ADC_NUM_CHANNELS; i++) {
-        // ADC is 10 bits => multiplying by 64 results in a left aligned 16 bit measurement.
-        adc_values[i] = adc_sum[i] * (64 / ADC_SAMPLES_PER_MEASUREMENT);
-        adc_sum[i] = 0;
+        adc_sum[buf][i] = 0;
     }
-    //Start next measurement
-    adc_count = 0;
-    ADC1->CR1 |= ADC1_CR1_ADON;
+    adc_count[buf] = 0;
+    adc_count_sense[buf] = 0;
+    adc_count_slow[buf] = 0;
+    adc_burst_sum[buf] = 0;
     adc_update();
 }
 
 uint16_t adc_get_voltage()
 {
-  if (v_sense > v_load) return v_sense;
-  return v_load;
+    return adc_remote_sense ? v_sense : v_load;
+}
+
+uint16_t adc_get_display_voltage()
+{
+    return adc_display[adc_remote_sense ? ADC_CH_SENSE : ADC_CH_LOAD];
 }
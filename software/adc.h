@@ -1,15 +1,47 @@
 #ifndef _ADC_H_
 #define _ADC_H_
 #include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
 #include "inc/stm8s_adc1.h"
 
+typedef struct {
+    uint16_t raw;   // Left aligned 16 bit ADC value
+    uint16_t value; // mV or 0.1°C
+} adc_cal_point_t;
+
 void adc_init();
 void adc_timer();
-/* Returns either v_load or v_sense depending on if v_sense is connected. */
+/* Load calibration from EEPROM, use defaults if it's invalid. */
+void adc_cal_init();
+/* Precompute the interpolation after adc_cal was changed and use the new table.
+   Returns 0 and keeps the previous table if the breakpoints are not sorted or
+   their slope is too large. */
+bool adc_cal_apply();
+/* Store calibration in EEPROM. */
+void adc_cal_update();
+extern adc_cal_point_t adc_cal[ADC_NUM_CHANNELS][ADC_CAL_POINTS];
+/* Per systick average (raw), used for control and protection */
+extern uint16_t adc_values[ADC_NUM_CHANNELS];
+/* Calibrated (mV or 0.1°C) after the decimation filter, for display and telemetry */
+extern uint16_t adc_display[ADC_NUM_CHANNELS];
+/* Scan ("burst") timing in us: duration from ADON to EOC and period from
+   start to start, measured with TIM4. Means are in 0.1 us, the mean period is
+   derived from the number of scans per systick. */
+void adc_timing_reset();
+extern uint8_t adc_burst_min, adc_burst_max;
+extern uint8_t adc_period_min, adc_period_max;
+extern uint16_t adc_burst_mean, adc_period_mean;
+/* Returns either v_load or v_sense depending on settings.sense_mode and
+   if v_sense is connected. */
 uint16_t adc_get_voltage();
+/* Same from adc_display */
+uint16_t adc_get_display_voltage();
 extern uint16_t temperature;
 extern uint16_t v_12V;
 extern uint16_t v_load;
 extern uint16_t v_sense;
+extern uint16_t v_lead; // Drop over the load leads in mV, 0 without remote sense
+extern bool adc_remote_sense;
 
 #endif
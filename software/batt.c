@@ -0,0 +1,116 @@
+#include "batt.h"
+#include "load.h"
+#include "adc.h"
+#include "settings.h"
+#include "ovld.h"
+
+/* Battery capacity test (MODE_BATTERY): Constant current discharge until the
+   voltage stays below settings.cutoff_voltage for settings.batt_debounce.
+   With SETTINGS_BATT_COMPENSATION the drop over the internal resistance is
+   added to the voltage first, so the test ends at the same open circuit
+   voltage independent of the current. The internal resistance is estimated
+   from the voltage before the start and BATT_RI_DELAY after it.
+   The integrated values are reset at the start and count the test's
+   capacity. The test ends when the load stops conducting, so a soft stop
+   after the cutoff is included. Each result is added to a ring buffer in
+   RAM. The program memory (the data EEPROM is full) is only specified for
+   100 write cycles, so the history is only written to it on request
+   (batt_history_update()). */
+batt_result_t batt_result;
+bool batt_running = 0;
+bool batt_report = 0;
+batt_history_t batt_history;
+static uint16_t batt_v_open;
+static uint32_t batt_ticks;
+static uint16_t batt_below;
+
+_Static_assert(sizeof(batt_history) < 128, "battery history doesn't fit into one flash block");
+
+void batt_init()
+{
+    if (!flash_read_block(BATT_FLASH, &batt_history, sizeof(batt_history)) ||
+        batt_history.next >= BATT_HISTORY) {
+        batt_history.next = 0;
+        for (uint8_t i = 0; i < BATT_HISTORY; i++) {
+            batt_history.results[i].duration = 0; // Unused entry
+        }
+    }
+}
+
+bool batt_history_update()
+{
+    if (load_conducting()) return 0; // The CPU stalls while the flash is written
+    flash_write_block(BATT_FLASH, &batt_history, sizeof(batt_history));
+    return 1;
+}
+
+static void batt_start()
+{
+    batt_running = 1;
+    batt_ticks = 0;
+    batt_below = 0;
+    batt_result.resistance = 0;
+    batt_result.complete = 0;
+    load_clear_counters();
+    ovld_clear();
+}
+
+/* Update the result from the counters */
+static void batt_summary()
+{
+    uint32_t mWs = load_mWatt_seconds(), mAs = load_mAmpere_seconds();
+    batt_result.duration = batt_ticks / F_SYSTICK;
+    batt_result.mAh = mAs / 3600;
+    batt_result.mWh = mWs / 3600;
+    batt_result.current = settings.setpoints[MODE_BATTERY];
+    // Average voltage = energy / charge. Scale both down to avoid an overflow.
+    while (mWs > UINT32_MAX / 1000) {
+        mWs >>= 1;
+        mAs >>= 1;
+    }
+    batt_result.voltage = mAs ? mWs * 1000 / mAs : 0;
+}
+
+static void batt_stop()
+{
+    batt_running = 0;
+    batt_summary();
+    batt_report = 1;
+    batt_history.results[batt_history.next] = batt_result;
+    if (++batt_history.next == BATT_HISTORY) batt_history.next = 0;
+}
+
+void batt_timer()
+{
+    uint16_t voltage = adc_get_voltage();
+
+    if (settings.mode != MODE_BATTERY || !load_conducting()) {
+        if (batt_running) batt_stop();
+        batt_v_open = voltage;
+        return;
+    }
+    if (!load_active) {
+        if (batt_running) batt_ticks++; // Soft stop
+        return;
+    }
+    if (!batt_running) batt_start();
+
+    batt_ticks++;
+    if (batt_ticks == BATT_RI_DELAY * F_SYSTICK && batt_v_open > voltage && current_setpoint) {
+        batt_result.resistance = (uint32_t)(batt_v_open - voltage) * 1000 / current_setpoint;
+    }
+    if (settings.flags & SETTINGS_BATT_COMPENSATION) {
+        uint32_t v = voltage + (uint32_t)current_setpoint * batt_result.resistance / 1000;
+        voltage = v < 0xffff ? v : 0xffff;
+    }
+    if (voltage < settings.cutoff_voltage) {
+        if (++batt_below >= settings.batt_debounce * (F_SYSTICK / 10)) {
+            batt_result.complete = 1; // batt_stop() follows after the soft stop
+            load_disable(DISABLE_BATTERY);
+            return;
+        }
+    } else {
+        batt_below = 0;
+    }
+    if (batt_ticks % F_SYSTICK == 0) batt_summary(); // Live values for the display
+}
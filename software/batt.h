@@ -0,0 +1,34 @@
+#ifndef _BATT_H_
+#define _BATT_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include "config.h"
+
+typedef struct {
+    uint32_t duration;   // s
+    uint32_t mWh;
+    uint16_t mAh;
+    uint16_t voltage;    // Average, mV
+    uint16_t resistance; // Internal resistance estimate, mOhm (0 = unknown)
+    uint16_t current;    // mA
+    uint8_t complete;    // 1 = cutoff voltage reached, 0 = stopped early
+} batt_result_t;
+
+typedef struct {
+    uint8_t next; // Oldest entry, overwritten next
+    batt_result_t results[BATT_HISTORY];
+} batt_history_t;
+
+/* Result of the running or last test */
+extern batt_result_t batt_result;
+extern bool batt_running;
+extern bool batt_report; // Set at the end of a test, cleared when printed
+extern batt_history_t batt_history;
+
+/* Load the history from flash, empty history if it's invalid. */
+void batt_init();
+/* Store the history in flash. Returns 0 while the load is active. */
+bool batt_history_update();
+/* Called every systick from the main loop before load_timer(). */
+void batt_timer();
+#endif
@@ -49,7 +49,7 @@ void beeper_init()
 
 void beeper_on()
 {
-    if (settings.beeper_enabled && !(BEEP->CSR & BEEP_CSR_BEEPEN)) {
+    if ((settings.flags & SETTINGS_BEEPER) && !(BEEP->CSR & BEEP_CSR_BEEPEN)) {
         BEEP->CSR |= BEEP_CSR_BEEPEN;
     }
 }
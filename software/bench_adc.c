@@ -0,0 +1,60 @@
+/* Cycle count benchmark for adc_irq(). Not part of the firmware, run with
+   "make bench-adc" in the ucsim STM8 simulator.
+   adc.c is built with ADC_BENCH so the IRQ is entered via the TRAP instruction.
+   The results therefore include interrupt entry and iret, but not the
+   interrupt latency of the real hardware. */
+
+#include "config.h"
+#include "inc/stm8s_uart2.h"
+#include "inc/stm8s_tim2.h"
+#include <stdio.h>
+
+#define BENCH_RUNS 100
+
+void adc_irq() __trap;
+
+int putchar(int c)
+{
+    UART2->DR = (char) c;
+    while (!(UART2->SR & (uint8_t)UART2_FLAG_TXE));
+    return c;
+}
+
+static uint16_t bench_time()
+{
+    uint16_t t = TIM2->CNTRH << 8; // Reading CNTRH latches CNTRL
+    return t | TIM2->CNTRL;
+}
+
+void main(void)
+{
+    uint16_t start, overhead, total;
+    uint8_t i;
+
+    uint16_t uart_div = (F_CPU + BAUDR/2) / BAUDR;
+    UART2->BRR2 = (uart_div >> 12) | (uart_div & 0x0f);
+    UART2->BRR1 = (uart_div >> 4);
+    UART2->CR2 = UART2_CR2_TEN;
+
+    // Count CPU cycles
+    TIM2->PSCR = TIM2_PRESCALER_1;
+    TIM2->ARRH = 0xff;
+    TIM2->ARRL = 0xff;
+    TIM2->CR1 = TIM2_CR1_CEN;
+
+    start = bench_time();
+    for (i = 0; i < BENCH_RUNS; i++) {
+        __asm__("nop");
+    }
+    overhead = bench_time() - start;
+
+    start = bench_time();
+    for (i = 0; i < BENCH_RUNS; i++) {
+        __asm__("trap");
+    }
+    total = bench_time() - start;
+
+    printf("adc_irq: %u cycles/irq\r\n", (total - overhead) / BENCH_RUNS);
+    __asm__("break"); // Stops the simulator
+    while (1);
+}
@@ -0,0 +1,94 @@
+/* Settling time and overshoot of the CV controller against simulated sources.
+   Host build of load.c, not part of the firmware. Run with "make bench-cv".
+
+   Usage: bench_cv [-p kp] [-i ki]   (gains as in settings, default config.h)
+
+   Model per systick: load_timer() sets current_setpoint, the current follows
+   through the first order low pass of the I-SET filter, the source has an
+   internal resistance and the measured voltage is the average of the last
+   systick (adc_values, see adc.c). Overshoot is how far the voltage drops below
+   the setpoint, settling time is when it stays within the band. */
+
+#include "load.h"
+#include "adc.h"
+#include "settings.h"
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define BENCH_TICKS (5 * F_SYSTICK)
+#define BENCH_SUBSTEPS 10
+#define BENCH_ISET_TAU 0.02 // s, hardware low pass is <8 Hz
+
+typedef struct {
+    double voc;  // mV
+    double r;    // Ohm
+    uint16_t setpoint; // mV
+} source_t;
+
+static const source_t sources[] = {
+    {12000, 1.0, 10000},
+    {12000, 0.2, 11500},
+    {20000, 5.0, 10000},
+    {30000, 10.0, 20000},
+    {5000, 0.5, 4000},
+};
+
+static void run(const source_t *src)
+{
+    double current = 0; // mA
+    double band = src->setpoint / 100.0 > 20 ? src->setpoint / 100.0 : 20;
+    double overshoot = 0, v = src->voc;
+    unsigned settled = 0;
+
+    v_load = v;
+    load_disable(DISABLE_USER);
+    load_timer();
+    load_enable();
+    for (unsigned tick = 0; tick < BENCH_TICKS; tick++) {
+        double v_avg = 0;
+        load_timer();
+        for (uint8_t i = 0; i < BENCH_SUBSTEPS; i++) {
+            current += (current_setpoint - current) / (F_SYSTICK * BENCH_SUBSTEPS * BENCH_ISET_TAU);
+            v = src->voc - current * src->r;
+            if (v < 0) v = 0;
+            v_avg += v / BENCH_SUBSTEPS;
+        }
+        if (src->setpoint - v_avg > overshoot) overshoot = src->setpoint - v_avg;
+        if (v_avg > src->setpoint + band || v_avg < src->setpoint - band) settled = tick + 1;
+        v_load = v_avg;
+    }
+    printf("%6.0f %5.1f %6u %7.0f %9.0f %8u %7.0f\n", src->voc, src->r, src->setpoint,
+        band, overshoot, settled * 1000 / F_SYSTICK, v - src->setpoint);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    load_init();
+    settings.mode = MODE_CV;
+    settings.current_limit = CUR_MAX;
+    settings.max_power_action = MAX_P_LIM;
+    settings.cv_kp = CV_KP_DEFAULT;
+    settings.cv_ki = CV_KI_DEFAULT;
+    while ((opt = getopt(argc, argv, "p:i:")) != -1) {
+        switch (opt) {
+            case 'p': settings.cv_kp = atoi(optarg); break;
+            case 'i': settings.cv_ki = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-p kp] [-i ki]\n", argv[0]);
+                return 1;
+        }
+    }
+    host_gpioc.IDR = PINC_OL_DETECT; // Always regulated
+
+    printf("kp %u ki %u (Q8)\n", settings.cv_kp, settings.cv_ki);
+    printf("Voc/mV R/Ohm Vset/mV band/mV overshoot/mV settle/ms error/mV\n");
+    for (uint8_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        settings.setpoints[MODE_CV] = sources[i].setpoint;
+        run(&sources[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+/* Thermal derating against simulated heat sinks. Host build of thermal.c, not
+   part of the firmware. Run with "make bench-thermal".
+
+   Model per systick: The load draws the requested power, limited by
+   thermal_power_limit. The heat sink is a first order system (thermal
+   resistance to ambient, time constant), the junction follows it like the
+   model in thermal.c. The sensor reads the heat sink in 0.1°C steps. Each run
+   reports the highest heat sink and junction temperature, whether the OTP
+   limit was reached and the power at the end. */
+
+#include "thermal.h"
+#include "load.h"
+#include "adc.h"
+#include "config.h"
+#include <stdio.h>
+
+#define BENCH_TIME 3600 // s
+#define BENCH_AMBIENT 25.0 // °C
+#define BENCH_VOLTAGE 12000 // mV
+
+typedef struct {
+    double power; // W
+    double r;     // K/W, heat sink to ambient
+    double tau;   // s, heat sink
+} heat_sink_t;
+
+static const heat_sink_t heat_sinks[] = {
+    {40, 1.0, 120},
+    {65, 1.0, 120}, // Heat sink derating
+    {65, 0.7, 120}, // Junction derating
+    {65, 0.7, 30},
+    {65, 0.5, 120},
+};
+
+static void run(const heat_sink_t *hs)
+{
+    double t_hs = BENCH_AMBIENT, rise = 0, power = 0;
+    double t_hs_max = 0, tj_max = 0;
+    unsigned derating = 0;
+
+    // Cool down thermal.c's model from the previous run with the load off
+    host_gpioe.ODR = PINE_ENABLE;
+    temperature = BENCH_AMBIENT * 10;
+    for (unsigned tick = 0; tick < 60 * F_SYSTICK; tick++) thermal_timer();
+    host_gpioe.ODR = 0;
+
+    for (unsigned tick = 0; tick < BENCH_TIME * F_SYSTICK; tick++) {
+        double requested = hs->power * 1000; // mW
+        if (requested > host_power_derating) requested = host_power_derating;
+        if (requested < (double)CUR_MIN * BENCH_VOLTAGE / 1000) requested = (double)CUR_MIN * BENCH_VOLTAGE / 1000;
+        current_setpoint = requested * 1000 / BENCH_VOLTAGE;
+        power = (double)current_setpoint * BENCH_VOLTAGE / 1e6; // W
+        t_hs += (BENCH_AMBIENT + power * hs->r - t_hs) / (hs->tau * F_SYSTICK);
+        rise += (power * THERMAL_R_JH / 10 - rise) / (THERMAL_TAU_J * F_SYSTICK);
+        temperature = t_hs * 10 + 0.5;
+        thermal_timer();
+        if (t_hs > t_hs_max) t_hs_max = t_hs;
+        if (t_hs + rise > tj_max) tj_max = t_hs + rise;
+        if (!derating && host_power_derating < hs->power * 1000) derating = tick / F_SYSTICK + 1;
+    }
+    printf("%5.0f %5.1f %5.0f %8.1f %7.1f %4s %9u %7.1f\n", hs->power, hs->r, hs->tau,
+        t_hs_max, tj_max, t_hs_max * 10 >= FAN_TEMPERATURE_OTP_LIMIT ? "yes" : "no",
+        derating, power);
+}
+
+int main()
+{
+    v_load = BENCH_VOLTAGE;
+    printf("OTP %.1f C, Tj max %.1f C, %u s\n", FAN_TEMPERATURE_OTP_LIMIT / 10.0,
+        THERMAL_TJ_MAX / 10.0, BENCH_TIME);
+    printf("  P/W R/K/W tau/s  Ths/max  Tj/max  OTP derate/s final/W\n");
+    for (uint8_t i = 0; i < sizeof(heat_sinks) / sizeof(heat_sinks[0]); i++) {
+        run(&heat_sinks[i]);
+    }
+    return 0;
+}
@@ -18,9 +18,6 @@
 #define BRIGHTNESS_BRIGHT 4
 #define BRIGHTNESS_DIM 2
 
-/* F_POWER_CALC must be an integer 1 <= f <= F_SYSTICK and an
-   integer divider of F_SYSTICK */
-#define F_POWER_CALC 100
 #define F_FAN 5
 #define F_BEEP_ERROR 2
 #define F_BEEP_CUTOFF 5
@@ -35,6 +32,86 @@
 #define CUR_MAX 10000 //mA
 #define CUR_DOT_OFFSET 3
 
+/* CV controller (see load.c). Gains are Q8 fractions of the estimated current
+   error per systick, tuned with "make bench-cv". */
+#define CV_KP_DEFAULT 64
+#define CV_KI_DEFAULT 48
+#define CV_GAIN_MAX 1024 // Upper limit of both gains (4x the whole error per systick)
+#define CV_DROP_MIN 100 // mV, lower bound of the source's voltage drop estimate
+#define CV_DELTA_MAX 500 // mA, limits the estimated current error
+
+/* Transient mode (see load.c). The edges are timed by TIM1 update events
+   (F_CPU / 65536 = ~244 Hz), the current path's low pass (<8 Hz) limits the
+   usable frequency anyway. */
+#define TRANSIENT_FREQ_MIN 1 // 0.1 Hz
+#define TRANSIENT_FREQ_MAX 500 // 0.1 Hz
+#define TRANSIENT_FREQ_DOT_OFFSET 1
+#define TRANSIENT_DUTY_MIN 1 // %
+#define TRANSIENT_DUTY_MAX 99 // %
+#define TRANSIENT_DUTY_DOT_OFFSET 3 // No dot on the 3 digit display
+
+/* DCIR mode (see load.c). The pulse length is rounded to TIM1 update events.
+   Pulses shorter than 100 ms don't reach the full current because of the
+   low pass. */
+#define DCIR_BASE_TIME 2 // s at the base current before each pulse
+#define DCIR_TIME_MIN 1 // 10 ms
+#define DCIR_TIME_MAX 1000 // 10 ms
+#define DCIR_TIME_DOT_OFFSET 2
+
+/* I-V sweep (see sweep.c) */
+#define SWEEP_STEPS_MIN 2
+#define SWEEP_STEPS_MAX 250
+#define SWEEP_STEPS_DOT_OFFSET 3 // No dot on the 3 digit display
+#define SWEEP_DWELL_MIN 2 // 10 ms
+#define SWEEP_DWELL_MAX 1000 // 10 ms
+#define SWEEP_DWELL_DOT_OFFSET 2
+#define SWEEP_COLLAPSE 10 // % of the open circuit voltage ends the sweep
+
+/* MPPT (see mppt.c). The current path's hardware low pass (<8 Hz, ~20 ms)
+   settles in the first half of the period, the voltage (unfiltered systick
+   averages, ~5 ms delay) is averaged over the second half. */
+#define MPPT_PERIOD 20 // systicks per perturbation
+#define MPPT_STEP_MIN 10 // mA
+#define MPPT_STEP_MAX 500 // mA
+#define MPPT_REPORT_TIME 2 // s
+
+/* Thermal model (see thermal.c). temperature is the heat sink's. */
+#define THERMAL_RATE 10 // Hz, model update
+#define THERMAL_R_JH 8 // 0.1 K/W, junction to temperature sensor
+#define THERMAL_TAU_J 3 // s, junction to heat sink time constant
+#define THERMAL_TJ_MAX 1250 // 0.1°C, predicted junction limit
+#define THERMAL_TJ_DERATE 100 // 0.1°C, junction derating starts this far below THERMAL_TJ_MAX
+#define THERMAL_DERATE_START (FAN_TEMPERATURE_OTP_LIMIT - 100) // 0.1°C, heat sink
+#define THERMAL_DERATE_END (FAN_TEMPERATURE_OTP_LIMIT - 20) // 0.1°C, minimum current from here
+#define THERMAL_SLOPE_TIME 10 // s, heat sink trend for the time to limit
+
+/* Run termination (see term.c). 0 = off for all limits. */
+#define TERM_TIME_MAX 60000 // 0.01 h
+#define TERM_TIME_DOT_OFFSET 2
+#define TERM_CHARGE_MAX 60000 // mAh
+#define TERM_CHARGE_DOT_OFFSET 3
+#define TERM_ENERGY_MAX 60000 // 10 mWh
+#define TERM_ENERGY_DOT_OFFSET 2
+#define TERM_TEMPERATURE_MAX FAN_TEMPERATURE_OTP_LIMIT // 0.1°C, heat sink
+#define TERM_TEMPERATURE_DOT_OFFSET 1
+#define TERM_DVDT_MAX VOLT_MAX // mV/min
+#define TERM_DVDT_DOT_OFFSET 3
+#define TERM_DVDT_INTERVAL 10 // s between voltage samples
+#define TERM_DVDT_SAMPLES 6 // The drop rate is measured over 1 min
+
+/* Overload detection (see ovld.c) */
+#define OVLD_TRIP_MAX 60000 // ms
+#define OVLD_TRIP_DOT_OFFSET 3
+
+/* Battery test (see batt.c) */
+#define BATT_RI_DELAY 1 // s after the start, internal resistance estimate
+#define BATT_DEBOUNCE_MIN 1 // 0.1 s
+#define BATT_DEBOUNCE_MAX 600 // 0.1 s
+#define BATT_DEBOUNCE_DOT_OFFSET 1
+
+#define RAMP_MAX 60000 // mA/s
+#define RAMP_DOT_OFFSET 3 // A/s
+
 #define POW_MIN 1 //mW
 #define POW_DOT_OFFSET 3
 
@@ -56,19 +133,76 @@
 #define AS_DOT_OFFSET 3
 #define WS_DOT_OFFSET 3
 
-/* Defintion of t and m:
+/* EEPROM layout (STM8S005: 128 bytes). Each block is followed by a checksum byte. */
+#define EEPROM_SETTINGS 0
+#define EEPROM_SETTINGS_SIZE 64
+#define EEPROM_ADC_CAL 64
+#define EEPROM_ADC_CAL_SIZE 49
+#define EEPROM_LOAD_CAL 113
+#define EEPROM_LOAD_CAL_SIZE 13
+
+/* Step sequencer (see seq.c). The data EEPROM is full, so the sequence is
+   stored in the last block of the program memory. The program memory is only
+   specified for 100 write cycles: Only store a sequence once it is final.
+   The firmware must stay below BATT_FLASH, "make" checks this (FLASH_END). */
+#define SEQ_FLASH 0xff80
+#define SEQ_MAX_STEPS 15
+/* Battery test history (see batt.c), also in the program memory. Only
+   written on request (H1), same write cycle limit as the sequence. */
+#define BATT_FLASH 0xff00
+#define BATT_HISTORY 6
+
+/* Number of breakpoints of the current calibration table (mA -> PWM).
+   The factors below are only used as defaults if there is no valid table.
+   Defintion of t and m:
    PWM = (current *  m - t) / 2^16 */
+#define LOAD_CAL_POINTS 3
 #define LOAD_CAL_T 8821987L
 #define LOAD_CAL_M 350445L
 
-/* Maximum: 64 */
-#define ADC_SAMPLES_PER_MEASUREMENT 64
+/* Minimum number of scans per systick. Fewer scans mean the ADC has stalled.
+   Nominal value is ~670, ~465 with remote sense (see adc_init()). */
+#define ADC_SAMPLES_MIN 64
+/* Half width of the outlier rejection window in raw ADC counts (10 bit). */
+#define ADC_OUTLIER_WINDOW 16
+/* Every n-th scan runs the fast control path (load_fast_update()), ~2.1 kHz
+   (~1.45 kHz with remote sense).
+   Must be a power of 2. */
+#define ADC_FAST_DIVIDER 32
+#define ADC_FAST_SHIFT 5 // log2(ADC_FAST_DIVIDER)
+/* Every n-th scan also converts the housekeeping channels (temperature, 12V
+   and v_sense without remote sense), ~40 samples per systick.
+   Power of 2, at most ADC_FAST_DIVIDER. */
+#define ADC_SLOW_INTERVAL 16
+/* 1: Use the hand optimized asm version of adc_irq(), 0: C version */
+#ifndef ADC_IRQ_ASM
+#define ADC_IRQ_ASM 1
+#endif
 #define ADC_NUM_CHANNELS 4
 #define ADC_CH_TEMPERATURE 0
 #define ADC_CH_LOAD 1
 #define ADC_CH_SENSE 2
 #define ADC_CH_12V 3
 
+/* Decimation filter (see adc.c): ORDER cascaded moving averages over
+   2^SHIFT systicks each. Only for the display and telemetry, the control
+   loop uses the unfiltered systick average. The voltages get the stronger
+   filter for steady readings. Temperature and 12V only need a light filter. */
+#define ADC_FILTER_ORDER_MAX 2
+#define ADC_FILTER_SHIFT_MAX 3
+#define ADC_FILTER_TEMP_ORDER  1
+#define ADC_FILTER_TEMP_SHIFT  2
+#define ADC_FILTER_LOAD_ORDER  2
+#define ADC_FILTER_LOAD_SHIFT  2
+#define ADC_FILTER_SENSE_ORDER 2
+#define ADC_FILTER_SENSE_SHIFT 2
+#define ADC_FILTER_12V_ORDER   1
+#define ADC_FILTER_12V_SHIFT   2
+
+
+/* Number of breakpoints per channel of the calibration tables stored in EEPROM.
+   The factors below are only used as defaults if there is no valid table. */
+#define ADC_CAL_POINTS 3
 
 /* Calibration data: hardware/temperature.ods */
 #define ADC_CAL_TEMP_M 42
@@ -91,6 +225,16 @@
 #define ADC_12V_MIN 10000 // mV
 #define ADC_INPUT_MAX 35000 // mV
 
+/* Remote sense detection (sense mode AUTO). The sense leads measure at the
+   source, so v_sense is at least v_load when they are connected and ~0 when not.
+   Switch to v_sense when v_sense >= v_load - v_load/2^ON_SHIFT and back to
+   v_load when v_sense < v_load - v_load/2^OFF_SHIFT. The new state has to be
+   stable for DEBOUNCE systicks. */
+#define ADC_SENSE_ON_SHIFT  3
+#define ADC_SENSE_OFF_SHIFT 2
+#define ADC_SENSE_DETECT_MIN 250 // mV, below this v_sense counts as open
+#define ADC_SENSE_DEBOUNCE 10 // systicks
+
 #define FAN_TEMPERATURE_OTP_LIMIT 850 // * 0.1°C
 #define FAN_TEMPERATURE_FULL 750 // * 0.1°C
 #define FAN_TEMPERATURE_LOW  400 // * 0.1°C
@@ -9,6 +9,13 @@
 #include "fan.h"
 #include "adc.h"
 #include "beeper.h"
+#include "seq.h"
+#include "batt.h"
+#include "sweep.h"
+#include "mppt.h"
+#include "thermal.h"
+#include "term.h"
+#include "ovld.h"
 #include "inc/stm8s_clk.h"
 #include "inc/stm8s_exti.h"
 #include "inc/stm8s_itc.h"
@@ -70,6 +77,8 @@ void main(void) {
     beeper_init();
     fan_init();
     settings_init();
+    seq_init();
+    batt_init();
 
     __asm__ ("rim");
     
@@ -93,6 +102,14 @@ void main(void) {
             adc_timer();
             fan_timer();
             ui_timer();
+            // The modules prepare the setpoints and limits for load_update()
+            seq_timer();
+            batt_timer();
+            sweep_timer();
+            mppt_timer();
+            thermal_timer();
+            term_timer();
+            ovld_timer();
             load_timer();
             uart_timer();
             systick_flag &= ~SYSTICK_COUNT;
@@ -113,3 +130,4 @@ void ui_button_irq() __interrupt(ITC_IRQ_PORTC);
 void uart_rx_irq() __interrupt(ITC_IRQ_UART2_RX);
 void systick_irq() __interrupt(ITC_IRQ_TIM2_OVF);
 void adc_irq() __interrupt(ITC_IRQ_ADC1);
+void load_transient_irq() __interrupt(ITC_IRQ_TIM1_OVF);
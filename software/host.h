@@ -0,0 +1,40 @@
+/* Host builds of firmware modules (replay_adc.c, bench_cv.c, bench_thermal.c).
+   Force-included (gcc -include) before every source file so the SPL headers
+   take the SDCC path and the peripherals point to plain structs instead of the
+   STM8 register space. The structs are defined in host_stubs.c. */
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#define HOST_BUILD
+#define __SDCC
+#define __SDCC_VERSION_MAJOR 4
+#define __SDCC_VERSION_MINOR 0
+#define __SDCC_VERSION_PATCH 0
+#define __interrupt(x)
+#define __trap
+#define __naked
+#define __asm__(x)
+#define ADC_IRQ_ASM 0
+
+#include "inc/stm8s.h"
+
+extern ADC1_TypeDef host_adc1;
+extern GPIO_TypeDef host_gpioc;
+extern GPIO_TypeDef host_gpioe;
+extern TIM1_TypeDef host_tim1;
+extern TIM4_TypeDef host_tim4;
+
+#undef ADC1
+#undef GPIOC
+#undef GPIOE
+#undef TIM1
+#undef TIM4
+#define ADC1 (&host_adc1)
+#define GPIOC (&host_gpioc)
+#define GPIOE (&host_gpioe)
+#define TIM1 (&host_tim1)
+#define TIM4 (&host_tim4)
+
+extern uint32_t host_power_derating; // mW, see host_stubs.c
+
+#endif
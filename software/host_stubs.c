@@ -0,0 +1,71 @@
+/* Stubs for the modules the host builds and benchmarks (replay_adc.c,
+   bench_adc.c, bench_cv.c, bench_thermal.c) don't link. Not part of the
+   firmware. Each tool links one or two firmware modules and this file; the
+   Makefile sets STUB_ADC and STUB_LOAD unless the tool links adc.c or load.c
+   itself. The host peripherals only exist with host.h (HOST_BUILD), bench_adc
+   runs on the simulated STM8 and uses the real registers. */
+
+#include "adc.h"
+#include "load.h"
+#include "settings.h"
+#include "systick.h"
+#include "config.h"
+
+#ifdef HOST_BUILD
+ADC1_TypeDef host_adc1;
+GPIO_TypeDef host_gpioc;
+GPIO_TypeDef host_gpioe;
+TIM1_TypeDef host_tim1;
+TIM4_TypeDef host_tim4;
+#endif
+
+/* settings.c: The tools set the fields they need, the rest stays 0 */
+settings_t settings;
+
+bool eeprom_read_block(uint16_t address, void *block, uint16_t size)
+{
+    (void) address; (void) block; (void) size;
+    return 0; // => default calibration
+}
+
+void eeprom_write_block(uint16_t address, void *block, uint16_t size)
+{
+    (void) address; (void) block; (void) size;
+}
+
+/* sweep.c, mppt.c and systick.c: No tool links them */
+uint16_t sweep_current;
+uint16_t mppt_current;
+
+void systick_timestamp(systick_timestamp_t *t)
+{
+    t->tick = 0;
+    t->count = 0;
+}
+
+#ifdef STUB_ADC
+/* Set by the tool instead of measured */
+uint16_t temperature;
+uint16_t v_load;
+
+uint16_t adc_get_voltage()
+{
+    return v_load;
+}
+#endif
+
+#ifdef STUB_LOAD
+error_t error = ERROR_NONE;
+uint16_t current_setpoint;
+uint32_t host_power_derating = POW_ABS_MAX; // Last load_set_power_derating()
+
+void load_fast_update(uint16_t voltage, uint16_t v_terminal)
+{
+    (void) voltage; (void) v_terminal;
+}
+
+void load_set_power_derating(uint32_t power)
+{
+    host_power_derating = power;
+}
+#endif
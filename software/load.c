@@ -2,14 +2,20 @@
 #include "config.h"
 #include "adc.h"
 #include "settings.h"
+#include "recip.h"
+#include "sweep.h"
+#include "mppt.h"
+#include "systick.h"
 #include "inc/stm8s_tim1.h"
+#include "inc/stm8s_itc.h"
 
 /* integrated values */
-uint32_t mAmpere_seconds = 0;
-uint32_t mWatt_seconds = 0;
+static uint64_t load_energy_512pJ = 0;
+static uint64_t load_charge_64nAs = 0;
 
 bool load_active = 0;
 bool load_regulated = 0;
+bool load_ramping = 0;
 uint16_t current_setpoint;
 
 /* Which condition disabled the load (user, cutoff or error) */
@@ -17,12 +23,100 @@ uint8_t load_disable_reason = DISABLE_USER;
 
 error_t error = ERROR_NONE;
 
-/* Calibration mode (unfinished) */
+/* Calibration mode: Output calibration_value as raw PWM value (see uart.c) */
 calibration_t calibration_step;
 uint16_t calibration_value;
 
+/* Current calibration: LOAD_CAL_POINTS breakpoints sorted by current. load_cal
+   is edited over UART, load_cal_apply() only copies it to load_cal_live once
+   it is valid. The slopes (PWM counts per mA, Q12) are precomputed at the same
+   time so the conversion needs no division. Below the first point the first
+   segment is extrapolated, above the last point the last one. */
+load_cal_point_t load_cal[LOAD_CAL_POINTS];
+static load_cal_point_t load_cal_live[LOAD_CAL_POINTS];
+static uint16_t load_cal_slope[LOAD_CAL_POINTS - 1];
+_Static_assert(sizeof(load_cal) < EEPROM_LOAD_CAL_SIZE, "current calibration doesn't fit into EEPROM");
+_Static_assert(EEPROM_LOAD_CAL + EEPROM_LOAD_CAL_SIZE <= 128, "EEPROM is only 128 bytes");
+
+static recip_t load_pow_max; // POW_ABS_MAX in mA * mV
+static recip_t load_pow_thermal; // Derated by the thermal model (see thermal.c)
+
+static void load_cal_default()
+{
+    for (uint8_t i = 0; i < LOAD_CAL_POINTS; i++) {
+        uint16_t current = CUR_MIN + (uint32_t)(CUR_MAX - CUR_MIN) * i / (LOAD_CAL_POINTS - 1);
+        load_cal[i].current = current;
+        load_cal[i].pwm = ((uint32_t)current * LOAD_CAL_M - LOAD_CAL_T) >> 16;
+    }
+}
+
+/* running: load_set_pwm() may run in the ADC IRQ, swap the tables with
+   interrupts disabled. At init time they are not enabled yet. */
+static bool load_cal_set(bool running)
+{
+    uint16_t slope[LOAD_CAL_POINTS - 1];
+    const load_cal_point_t *p = load_cal;
+    for (uint8_t i = 0; i < LOAD_CAL_POINTS - 1; i++, p++) {
+        uint32_t s;
+        if (p[1].current <= p[0].current || p[1].pwm <= p[0].pwm) {
+            return 0; // Breakpoints must be sorted
+        }
+        s = ((uint32_t)(p[1].pwm - p[0].pwm) << 12) / (p[1].current - p[0].current);
+        if (s > 0xffff) {
+            return 0; // 16 counts/mA is far beyond the hardware's gain
+        }
+        slope[i] = s;
+    }
+    // load_set_pwm() also runs in the ADC IRQ
+    if (running) disableInterrupts();
+    for (uint8_t i = 0; i < LOAD_CAL_POINTS; i++) {
+        load_cal_live[i].current = load_cal[i].current;
+        load_cal_live[i].pwm = load_cal[i].pwm;
+        if (i < LOAD_CAL_POINTS - 1) {
+            load_cal_slope[i] = slope[i];
+        }
+    }
+    if (running) enableInterrupts();
+    return 1;
+}
+
+bool load_cal_apply()
+{
+    return load_cal_set(1);
+}
+
+void load_cal_init()
+{
+    if (!eeprom_read_block(EEPROM_LOAD_CAL, load_cal, sizeof(load_cal)) || !load_cal_set(0)) {
+        load_cal_default();
+        load_cal_set(0);
+    }
+}
+
+void load_cal_update()
+{
+    eeprom_write_block(EEPROM_LOAD_CAL, load_cal, sizeof(load_cal));
+}
+
+static uint16_t load_cal_pwm(uint16_t current)
+{
+    const load_cal_point_t *p = load_cal_live;
+    uint8_t i = 0;
+    uint32_t d;
+    if (current < p[0].current) {
+        d = ((uint32_t)(p[0].current - current) * load_cal_slope[0]) >> 12;
+        return d < p[0].pwm ? p[0].pwm - d : 0;
+    }
+    while (i < LOAD_CAL_POINTS - 2 && current >= p[i+1].current) i++;
+    d = p[i].pwm + (((uint32_t)(current - p[i].current) * load_cal_slope[i]) >> 12);
+    return d > 0xffff ? 0xffff : d;
+}
+
 void load_init()
 {
+    load_pow_max = recip_from(POW_ABS_MAX * 1000UL);
+    load_pow_thermal = load_pow_max;
+    load_cal_init();
     #define PWM_RELOAD (F_CPU / F_PWM)
     // I-SET
     // Hardware low pass is <8 Hz, so we can use full 16 bit resolution (~244Hz).
@@ -31,7 +125,7 @@ void load_init()
     TIM1->PSCRH = 0;
     TIM1->PSCRL = 0;
 
-    TIM1->CCMR1 = TIM1_OCMODE_PWM1 | TIM1_CCMR_OCxPE;
+    TIM1->CCMR1 = TIM1_OCMODE_PWM1 | TIM1_CCMR_OCxPE;
     TIM1->CCER1 = TIM1_CCER1_CC1E;
     TIM1->CCR1H = 0;
     TIM1->CCR1L = 0;
@@ -43,7 +137,17 @@ void load_disable(uint8_t reason)
 {
     load_disable_reason = reason;
     load_active = 0;
-    GPIOE->ODR |= PINE_ENABLE;
+    // Errors switch off immediately, otherwise load_update() ramps down first
+    if (reason == DISABLE_ERROR || !settings.ramp_rate) GPIOE->ODR |= PINE_ENABLE;
+}
+
+void load_set_power_derating(uint32_t power)
+{
+    recip_t p = recip_from(power * 1000);
+    // load_limit() also runs in the ADC IRQ
+    disableInterrupts();
+    load_pow_thermal = p;
+    enableInterrupts();
 }
 
 void load_enable()
@@ -52,103 +156,81 @@ void load_enable()
     //actual activation happens in load_update()
 }
 
-static inline void load_update()
+/* CV mode: PI controller. The voltage error is converted to a current error
+   with the source's resistance R = (v_open - voltage) / current, where v_open
+   is the voltage measured before the load was enabled. This keeps the loop gain
+   independent of the source (0.1 Ohm power supply vs. 10 Ohm solar panel).
+   delta = (voltage - setpoint) / R is limited to CV_DELTA_MAX, so the gains
+   (Q8, 256 = whole error in one systick) also set the maximum slew rate.
+   The integral is kept in mA Q8. A D term doesn't help here: The current path's
+   hardware low pass (<8 Hz, ~20 ms) and the voltage being the average over the
+   previous systick (~5 ms delay) add more phase lag than it could compensate. */
+static int32_t cv_integral;
+static int32_t cv_proportional;
+static uint16_t cv_v_open;
+
+static inline uint16_t load_cv_update(uint16_t voltage, uint16_t setpoint)
 {
-    uint16_t setpoint = settings.setpoints[settings.mode];
-    uint16_t current = 0;
-    uint16_t voltage = adc_get_voltage();
-    static uint16_t last_current = 0;
-    static int16_t step_size = 1;
-    #define STEP_SIZE_MAX 200
+    int32_t e = (int32_t)voltage - setpoint;
+    int32_t delta, out;
+    uint16_t drop;
 
-    if (error) {
-        load_disable(DISABLE_ERROR);
-        return;
+    if (!load_active) {
+        cv_v_open = voltage;
+        cv_integral = (int32_t)CUR_MIN << 8; // Start with minimum current
+        return CUR_MIN;
     }
+    if (e > INT16_MAX) e = INT16_MAX;
+    if (e < INT16_MIN) e = INT16_MIN;
+    drop = CV_DROP_MIN;
+    if (cv_v_open > voltage + CV_DROP_MIN) drop = cv_v_open - voltage;
+    // |e| * current_setpoint / drop without a 32 bit division
+    delta = recip_mul(recip_from((uint32_t)(e < 0 ? -e : e) * current_setpoint), recip_inv(drop));
+    if (delta > CV_DELTA_MAX) delta = CV_DELTA_MAX;
+    if (e < 0) delta = -delta;
+    cv_proportional = settings.cv_kp * delta;
+    cv_integral += settings.cv_ki * delta;
+    if (cv_integral < 0) cv_integral = 0;
+    if (cv_integral > (int32_t)CUR_MAX << 8) cv_integral = (int32_t)CUR_MAX << 8;
+    out = (cv_proportional + cv_integral) >> 8;
+    if (out < CUR_MIN) return CUR_MIN;
+    if (out > CUR_MAX) return CUR_MAX;
+    return out;
+}
 
-    /* Calibration mode */
-    if (calibration_step == CAL_CURRENT) {
-        TIM1->CCR1H = calibration_value >> 8;
-        TIM1->CCR1L = calibration_value & 0xff;
-        return;
+/* Anti-windup: When the output was limited (min/max current, current limit,
+   power limit) track the integral to the actually used current. */
+static inline void load_cv_limit(uint16_t current)
+{
+    int32_t out = (cv_proportional + cv_integral) >> 8;
+    if (out != current) {
+        cv_integral = ((int32_t)current << 8) - cv_proportional;
+        if (cv_integral < 0) cv_integral = 0;
     }
+}
 
-    switch (settings.mode) {
-        case MODE_CC:
-            current = setpoint;
-            break;
-        case MODE_CV:
-            if (!load_active) {
-                current = CUR_MIN; // Start with minimum current ...
-                step_size = STEP_SIZE_MAX/2; // ... and a large positive step size
-            } else {
-                current = last_current; // Use last current and make adjustments
-            }
-
-            if (voltage < setpoint) {
-                //Current too high
-                /* Find current which corresponds to set voltage with increasing steps.
-                 TODO: Step size should depend on error between measured value and setpoint. */
-                if (step_size < 0) {
-                    if (step_size > -STEP_SIZE_MAX) {
-                        step_size--;
-                    }
-                } else {
-                    //Last step was positive
-                    step_size = -1;
-                }
-                if (step_size > 0) {
-                    error = ERROR_INTERNAL;
-                }
-                if (current > CUR_MIN - step_size) {
-                    current += step_size / 16;
-                } else {
-                    current = CUR_MIN;
-                }
-            } else {
-                //Current too low
-                if (step_size > 0) {
-                    if (step_size < STEP_SIZE_MAX) {
-                        step_size++;
-                    }
-                } else {
-                    //Last step was negative
-                    step_size = 1;
-                }
-                if (step_size < 0) {
-                    error = ERROR_INTERNAL;
-                }
-                if (current < CUR_MAX - step_size) {
-                    current += step_size / 16;
-                } else {
-                    current = CUR_MAX;
-                }
-            }
-            last_current = current;
-            break;
-        case MODE_CR:
-            // Fixed point scaling:
-            // U[mV]/R[10mOhm]=I[mA]
-            // U * 1000 * c / R * 100 = I * 1000
-            // => c = 100
-            current = (uint32_t)voltage * 100 / setpoint;
-            break;
-        case MODE_CW:
-            // Fixed point scaling:
-            // P[mW]/U[mV] = I[mA]
-            // P * 1000 * c / U * 1000 = I * 1000
-            // => c = 1000
-            current = (uint32_t)setpoint * 1000 / voltage;
-            break;
-    }
+/* Modes whose setpoint is the current */
+#define LOAD_CURRENT_MODES ((1 << MODE_CC) | (1 << MODE_TRANSIENT) | (1 << MODE_BATTERY) | \
+    (1 << MODE_DCIR) | (1 << MODE_SWEEP) | (1 << MODE_MPPT))
+
+/* Common limits of all modes. Sets ERROR_OVERLOAD if the power limit is
+   exceeded and max_power_action is MAX_P_OFF. */
+static uint16_t load_limit(uint16_t current, uint16_t v_terminal)
+{
     /* NOTE: Here v_load is used directly instead of adc_get_voltage, because
        for the MOSFET's power dissipation only the voltage that reaches the load's
        terminals is relevant. */
-    uint16_t current_power_limited = (uint32_t)(POW_ABS_MAX) * 1000 / v_load;
+    recip_t inv = recip_inv(v_terminal);
+    uint16_t current_power_limited = recip_mul(load_pow_max, inv);
+    uint16_t current_thermal = recip_mul(load_pow_thermal, inv);
+    /* Thermal derating always limits, but keeps the minimum current */
+    if (current > current_thermal) current = current_thermal;
     if (current < CUR_MIN) current = CUR_MIN;
     if (current > CUR_MAX) current = CUR_MAX;
     /* Stay below the current limit in all modes. */
-    if (settings.mode != MODE_CC && current > settings.current_limit) current = settings.current_limit;
+    if (!(LOAD_CURRENT_MODES & (1 << settings.mode)) && current > settings.current_limit) {
+        current = settings.current_limit;
+    }
     if (load_active && (current > current_power_limited)) {
         if (settings.max_power_action == MAX_P_LIM) {
             current = current_power_limited;
@@ -156,16 +238,414 @@ static inline void load_update()
             error = ERROR_OVERLOAD;
         }
     }
-    current_setpoint = current;
+    return current;
+}
+
+/* Convert current to PWM value */
+static void load_set_pwm(uint16_t current)
+{
+    uint16_t pwm = load_cal_pwm(current);
+    TIM1->CCR1H = pwm >> 8;
+    TIM1->CCR1L = pwm & 0xff;
+}
 
-    /* Convert current to PWM value */
-    uint32_t tmp = current;
-    tmp = tmp * LOAD_CAL_M - LOAD_CAL_T;
-    TIM1->CCR1H = tmp >> 24;
-    TIM1->CCR1L = tmp >> 16;
+/* Slew rate limit (settings.ramp_rate in mA/s, 0 = off) of the current
+   requested by the mode, before the common limits are applied so the power
+   limit always acts immediately. load_ramp is the ramped current in mA Q16
+   and moves by at most load_ramp_step per systick. It starts at CUR_MIN when
+   the load is enabled (soft start) and ramps back to CUR_MIN before the load
+   is switched off by the user or the cutoff (soft stop).
+   load_fast_update() is kept within the window that can be reached in the
+   current systick. */
+static uint32_t load_ramp;
+static uint32_t load_ramp_step;
+static uint16_t load_ramp_rate;
+static uint16_t load_ramp_lo, load_ramp_hi = 0xffff; // mA, for load_fast_update()
+
+static uint16_t load_ramp_update(uint16_t current)
+{
+    uint32_t target = (uint32_t)current << 16;
+    if (settings.ramp_rate != load_ramp_rate) {
+        load_ramp_rate = settings.ramp_rate;
+        load_ramp_step = ((uint32_t)load_ramp_rate << 16) / F_SYSTICK;
+    }
+    if (!load_active) target = (uint32_t)CUR_MIN << 16;
+    if (!load_ramp_rate) {
+        load_ramp = target;
+        load_ramping = 0;
+        return current;
+    }
+    if (GPIOE->ODR & PINE_ENABLE) load_ramp = (uint32_t)CUR_MIN << 16; // Load is off
+    if (target > load_ramp + load_ramp_step) {
+        load_ramp += load_ramp_step;
+    } else if (target + load_ramp_step < load_ramp) {
+        load_ramp -= load_ramp_step;
+    } else {
+        load_ramp = target;
+    }
+    load_ramping = load_ramp != target;
+    return load_ramp >> 16;
+}
+
+static void load_ramp_window()
+{
+    uint16_t lo = 0, hi = 0xffff;
+    if (load_ramp_rate) {
+        lo = load_ramp > load_ramp_step ? (load_ramp - load_ramp_step) >> 16 : 0;
+        hi = (load_ramp + load_ramp_step) >> 16;
+    }
+    disableInterrupts();
+    load_ramp_lo = lo;
+    load_ramp_hi = hi;
+    enableInterrupts();
+}
+
+/* CR and CW multiply with a cached factor instead of dividing:
+   CR: I[mA] = U[mV] * 100 / R[10mOhm] => factor = 100 / R
+   CW: I[mA] = P[mW] * 1000 / U[mV] => factor = P * 1000, times 1/U
+   load_factor_mode tells load_fast_update() which mode the factor belongs to. */
+static recip_t load_factor;
+static uint16_t load_factor_setpoint;
+static uint8_t load_factor_mode = NUM_MODES;
+
+static void load_update_factor(uint16_t setpoint)
+{
+    recip_t f;
+    if (setpoint == load_factor_setpoint && settings.mode == load_factor_mode) return;
+    if (settings.mode == MODE_CR) {
+        f = recip_div(100, setpoint);
+    } else {
+        f = recip_from((uint32_t)setpoint * 1000);
+    }
+    disableInterrupts();
+    load_factor = f;
+    load_factor_setpoint = setpoint;
+    load_factor_mode = settings.mode;
+    enableInterrupts();
+}
+
+static uint16_t load_mode_current(uint16_t voltage)
+{
+    if (load_factor_mode == MODE_CR) {
+        return recip_mul(recip_from(voltage), load_factor);
+    }
+    return recip_mul(load_factor, recip_inv(voltage));
+}
+
+/* CR and CW follow the input voltage. While the load is active they are
+   regulated by load_fast_update() at the ADC rate. Like adc_fast_irq() it
+   only uses shifts and multiplications, no divisions. load_active, the mode and
+   the calibration step only change in the main loop, so either load_update()
+   or load_fast_update() writes CCR1, never both. */
+bool load_conducting()
+{
+    return !(GPIOE->ODR & PINE_ENABLE);
+}
 
-    /* Check cutoff voltage */
-    if (load_active && settings.cutoff_enabled && voltage < settings.cutoff_voltage) {
+static inline bool load_fast_active()
+{
+    return load_active && calibration_step == CAL_NONE &&
+        (settings.mode == MODE_CR || settings.mode == MODE_CW);
+}
+
+static uint16_t load_fast_current;
+static uint16_t load_fast_target; // Before load_limit(), for the ramp
+/* Voltage sum since the last TIM1 update event while switching (for DCIR) */
+static uint32_t load_fast_vsum;
+static uint8_t load_fast_vcount;
+
+/* Energy integration at the ADC rate (trapezoidal rule). Each sample adds
+   the area of the interval since the last one, the voltage is the interval's
+   average. The current is the one that was set during the interval. The
+   interval is measured with TIM2 because the sample rate depends on the scan
+   (remote sense) and the first sample after a buffer swap is skipped.
+   (power + last power) * dt is in 0.25 pJ and (current + last current) * dt
+   in 0.25 nAs, the parts below the counters' units are carried in the
+   fractions. Samples while the load is unregulated are left out because the
+   real current is unknown (ovld.c measures that time). */
+#define LOAD_INT_DT_MAX 4095 // TIM2 counts, limits the gap after the load was idle
+static systick_timestamp_t load_int_time;
+static uint16_t load_int_energy_fraction; // 0.25 pJ
+static uint8_t load_int_charge_fraction; // 0.25 nAs
+static uint32_t load_int_last_power; // uW
+static uint16_t load_int_last_current;
+
+static void load_integrate(uint16_t voltage, uint16_t current)
+{
+    systick_timestamp_t now;
+    uint32_t power, sum;
+    uint16_t dt;
+
+    systick_timestamp(&now);
+    if (now.tick == load_int_time.tick) {
+        dt = now.count - load_int_time.count;
+    } else if (now.tick == load_int_time.tick + 1) {
+        dt = now.count + SYSTICK_RELOAD - load_int_time.count;
+    } else {
+        dt = LOAD_INT_DT_MAX;
+    }
+    if (dt > LOAD_INT_DT_MAX) dt = LOAD_INT_DT_MAX;
+    load_int_time = now;
+
+    if (GPIOE->ODR & PINE_ENABLE) current = 0; // Load is off
+    power = (uint32_t)current * voltage;
+    if (!current || (GPIOC->IDR & PINC_OL_DETECT)) {
+        sum = power + load_int_last_power;
+        load_energy_512pJ += (sum >> 11) * dt;
+        sum = (sum & 0x7ff) * dt + load_int_energy_fraction;
+        load_energy_512pJ += sum >> 11;
+        load_int_energy_fraction = sum & 0x7ff;
+        sum = (uint32_t)(current + load_int_last_current) * dt + load_int_charge_fraction;
+        load_charge_64nAs += sum >> 8;
+        load_int_charge_fraction = sum & 0xff;
+    }
+    load_int_last_power = power;
+    load_int_last_current = current;
+}
+
+/* Called from adc_fast_irq() */
+void load_fast_update(uint16_t voltage, uint16_t v_terminal)
+{
+    uint16_t current;
+    load_integrate(voltage, load_fast_active() ? load_fast_current : current_setpoint);
+    if (TIM1->IER & TIM1_IER_UIE) {
+        load_fast_vsum += voltage;
+        load_fast_vcount++;
+    }
+    // Wait for load_update() to cache the factor after a mode change
+    if (!load_fast_active() || error || settings.mode != load_factor_mode) return;
+    current = load_mode_current(voltage);
+    if (current < load_ramp_lo) current = load_ramp_lo;
+    if (current > load_ramp_hi) current = load_ramp_hi;
+    load_fast_target = current;
+    current = load_limit(current, v_terminal);
+    load_set_pwm(current);
+    load_fast_current = current;
+}
+
+/* Transient mode: Alternates between the high level (setpoints[MODE_TRANSIENT])
+   and transient_low, starting with the high level. load_update() calculates
+   the PWM values and the duration of both phases in TIM1 update events,
+   load_transient_irq() switches between them. CCR1 is preloaded, so the new
+   value takes effect at the next update event independent of the interrupt
+   latency. The TIM1 update interrupt is only enabled while the mode runs.
+   Switching starts once the ramp reached the starting level.
+   MODE_DCIR uses the same switching: DCIR_BASE_TIME at the base current
+   (setpoints[MODE_DCIR]), then dcir_time at dcir_pulse. */
+#define TRANSIENT_UPDATES (((F_CPU * 10) + 32768) / 65536) // TIM1 updates per 10 s
+static uint16_t load_transient_pwm[2]; // Index: 0 = low/base, 1 = high/pulse
+static uint16_t load_transient_current[2];
+static uint16_t load_transient_counts[2];
+static uint16_t load_transient_count;
+static uint8_t load_transient_phase;
+static uint8_t load_transient_mode = NUM_MODES;
+static uint16_t load_transient_freq;
+static uint16_t load_transient_duty;
+
+/* DCIR: At each edge load_transient_irq() keeps the voltage sum of the phase
+   that ends, so both voltages are measured in the last TIM1 period before
+   the current changes. A new CCR1 value takes effect one update event after
+   it was written, so the pulse must last at least two periods. */
+dcir_result_t dcir_result;
+bool dcir_report = 0;
+static uint32_t load_dcir_vsum[2];
+static uint8_t load_dcir_vcount[2];
+static bool load_dcir_done;
+
+static inline bool load_transient_active()
+{
+    return load_active && calibration_step == CAL_NONE && !error &&
+        (settings.mode == MODE_TRANSIENT || settings.mode == MODE_DCIR);
+}
+
+static inline bool load_transient_running()
+{
+    return TIM1->IER & TIM1_IER_UIE;
+}
+
+static void load_transient_timing()
+{
+    uint16_t period, high;
+    if (settings.mode == MODE_DCIR) {
+        if (load_transient_mode == MODE_DCIR && settings.dcir_time == load_transient_duty) return;
+        high = ((uint32_t)settings.dcir_time * TRANSIENT_UPDATES + 500) / 1000;
+        if (high < 2) high = 2; // See load_transient_irq()
+        period = DCIR_BASE_TIME * TRANSIENT_UPDATES / 10 + high;
+        load_transient_freq = 0;
+        load_transient_duty = settings.dcir_time;
+    } else {
+        if (load_transient_mode == MODE_TRANSIENT &&
+            settings.transient_freq == load_transient_freq &&
+            settings.transient_duty == load_transient_duty) return;
+        period = (TRANSIENT_UPDATES + settings.transient_freq / 2) / settings.transient_freq;
+        if (period < 2) period = 2;
+        high = ((uint32_t)period * settings.transient_duty + 50) / 100;
+        load_transient_freq = settings.transient_freq;
+        load_transient_duty = settings.transient_duty;
+    }
+    if (high < 1) high = 1;
+    if (high > period - 1) high = period - 1;
+    disableInterrupts();
+    load_transient_counts[0] = period - high;
+    load_transient_counts[1] = high;
+    enableInterrupts();
+    load_transient_mode = settings.mode;
+}
+
+static void load_transient_update(uint16_t low, uint16_t high)
+{
+    uint16_t pwm_low, pwm_high;
+    uint8_t phase = settings.mode == MODE_DCIR ? 0 : 1; // Starting level
+    low = load_limit(low, v_load);
+    pwm_low = load_cal_pwm(low);
+    high = load_limit(high, v_load);
+    pwm_high = load_cal_pwm(high);
+    load_transient_timing();
+    disableInterrupts();
+    load_transient_pwm[0] = pwm_low;
+    load_transient_pwm[1] = pwm_high;
+    load_transient_current[0] = low;
+    load_transient_current[1] = high;
+    if (!load_transient_running()) {
+        load_transient_phase = phase;
+        load_transient_count = load_transient_counts[phase];
+        load_dcir_done = 0;
+        TIM1->CCR1H = load_transient_pwm[phase] >> 8;
+        TIM1->CCR1L = load_transient_pwm[phase] & 0xff;
+        TIM1->SR1 &= ~TIM1_SR1_UIF;
+        TIM1->IER |= TIM1_IER_UIE;
+    }
+    current_setpoint = load_transient_current[load_transient_phase];
+    enableInterrupts();
+}
+
+void load_transient_irq() __interrupt(ITC_IRQ_TIM1_OVF)
+{
+    TIM1->SR1 &= ~TIM1_SR1_UIF;
+    if (--load_transient_count == 0) {
+        uint16_t pwm;
+        load_dcir_vsum[load_transient_phase] = load_fast_vsum;
+        load_dcir_vcount[load_transient_phase] = load_fast_vcount;
+        if (load_transient_phase) load_dcir_done = 1;
+        load_transient_phase ^= 1;
+        load_transient_count = load_transient_counts[load_transient_phase];
+        pwm = load_transient_pwm[load_transient_phase];
+        TIM1->CCR1H = pwm >> 8;
+        TIM1->CCR1L = pwm & 0xff;
+        current_setpoint = load_transient_current[load_transient_phase]; // For load_integrate()
+    }
+    load_fast_vsum = 0;
+    load_fast_vcount = 0;
+}
+
+/* Calculate the result after each pulse */
+static void load_dcir_update()
+{
+    uint32_t sum[2];
+    uint8_t count[2];
+    int32_t dv, di, r;
+    disableInterrupts();
+    if (!load_dcir_done) {
+        enableInterrupts();
+        return;
+    }
+    load_dcir_done = 0;
+    sum[0] = load_dcir_vsum[0];
+    sum[1] = load_dcir_vsum[1];
+    count[0] = load_dcir_vcount[0];
+    count[1] = load_dcir_vcount[1];
+    dcir_result.i_base = load_transient_current[0];
+    dcir_result.i_pulse = load_transient_current[1];
+    enableInterrupts();
+    if (!count[0] || !count[1]) return; // No ADC values, shouldn't happen
+    dcir_result.v_base = sum[0] / count[0];
+    dcir_result.v_pulse = sum[1] / count[1];
+    dv = (int32_t)dcir_result.v_base - dcir_result.v_pulse;
+    di = (int32_t)dcir_result.i_pulse - dcir_result.i_base;
+    r = di ? dv * 1000 / di : 0;
+    if (r < 0) r = 0; // Noise or a wrong sign of the current step
+    dcir_result.resistance = r > 0xffff ? 0xffff : r;
+    dcir_report = 1;
+}
+
+static inline void load_update()
+{
+    uint16_t setpoint = settings.setpoints[settings.mode];
+    uint16_t current = 0;
+    uint16_t voltage = adc_get_voltage();
+
+    if (!load_transient_active() || settings.mode != load_transient_mode) {
+        // Stop switching before anything else writes CCR1 (restarts after a mode change)
+        TIM1->IER &= ~TIM1_IER_UIE;
+    }
+    if (error) {
+        load_disable(DISABLE_ERROR);
+        return;
+    }
+
+    if (settings.mode == MODE_CR || settings.mode == MODE_CW) {
+        load_update_factor(setpoint);
+    }
+    if (calibration_step == CAL_CURRENT) {
+        /* Raw PWM value, but never more than the power limit allows */
+        uint16_t max = recip_mul(load_pow_max, recip_inv(v_load));
+        uint16_t pwm = load_cal_pwm(max < CUR_MAX ? max : CUR_MAX);
+        if (calibration_value < pwm) pwm = calibration_value;
+        TIM1->CCR1H = pwm >> 8;
+        TIM1->CCR1L = pwm & 0xff;
+        current_setpoint = 0; // Unknown, measured externally
+        load_ramp = (uint32_t)CUR_MIN << 16;
+    } else if (load_fast_active()) {
+        disableInterrupts();
+        current_setpoint = load_fast_current;
+        current = load_fast_target;
+        enableInterrupts();
+        load_ramp_update(current);
+    } else if (load_transient_active() &&
+               (load_transient_running() || load_ramp == (uint32_t)setpoint << 16)) {
+        if (settings.mode == MODE_DCIR) {
+            load_transient_update(setpoint, settings.dcir_pulse);
+            load_dcir_update();
+        } else {
+            load_transient_update(settings.transient_low, setpoint);
+        }
+        load_ramp = (uint32_t)current_setpoint << 16; // Soft stop from the actual level
+    } else {
+        switch (settings.mode) {
+            case MODE_CC:
+            case MODE_BATTERY:
+            case MODE_TRANSIENT: // Only while the load is off or ramping
+            case MODE_DCIR:
+                current = setpoint;
+                break;
+            case MODE_SWEEP:
+                current = sweep_current;
+                break;
+            case MODE_MPPT:
+                current = mppt_current;
+                break;
+            case MODE_CV:
+                current = load_cv_update(voltage, setpoint);
+                break;
+            case MODE_CR:
+            case MODE_CW:
+                current = load_mode_current(voltage);
+                break;
+            default: // NUM_MODES is not a mode
+                current = CUR_MIN;
+                break;
+        }
+        current = load_limit(load_ramp_update(current), v_load);
+        if (settings.mode == MODE_CV && load_active) load_cv_limit(current);
+        current_setpoint = current;
+        load_set_pwm(current);
+        load_fast_target = load_ramp >> 16; // Start point for load_fast_update()
+    }
+    load_ramp_window();
+
+    /* Check cutoff voltage (battery tests use their own, see batt.c) */
+    if (load_active && (settings.flags & SETTINGS_CUTOFF) && settings.mode != MODE_BATTERY &&
+        voltage < settings.cutoff_voltage) {
         load_disable(DISABLE_CUTOFF);
     }
 
@@ -173,41 +653,50 @@ static inline void load_update()
 
     // Only turn on load if no error condition is present
     if (load_active && (error == ERROR_NONE)) GPIOE->ODR &= ~PINE_ENABLE;
+    // Soft stop finished
+    if (!load_active && load_ramp <= (uint32_t)CUR_MIN << 16) GPIOE->ODR |= PINE_ENABLE;
 }
 
-/* Update integrated values (Ah and Wh) */
-static inline void load_calc_power()
+uint64_t load_energy()
 {
-    static uint16_t timer = 0;
-    static uint8_t power_remainder = 0; //Remainder from last cycle's division
-    static uint8_t current_remainder = 0;
-    #if F_SYSTICK % F_POWER_CALC != 0
-        #error "F_POWER_CALC must be an integer divider of F_SYSTICK"
-    #endif
-    if (!load_active || !load_regulated) {
-        // Don't update readings when the exact values are unknown
-        return;
-    }
-    timer++;
-    if (timer == F_SYSTICK/F_POWER_CALC) {
-        timer = 0;
+    uint64_t energy;
+    disableInterrupts();
+    energy = load_energy_512pJ;
+    enableInterrupts();
+    return energy;
+}
+
+uint64_t load_charge()
+{
+    uint64_t charge;
+    disableInterrupts();
+    charge = load_charge_64nAs;
+    enableInterrupts();
+    return charge;
+}
 
-        uint32_t power = current_setpoint;
-        power *= adc_get_voltage();
-        uint16_t power16 = power / 1000;
-        power16 += power_remainder; //Keep track of rounding errors
-        power_remainder = power16 % F_POWER_CALC;
-        mWatt_seconds += power16 / F_POWER_CALC;
+uint32_t load_mWatt_seconds()
+{
+    return load_energy() / ENERGY_PER_MWS;
+}
 
-        uint16_t current = current_setpoint + current_remainder;
-        current_remainder = current % F_POWER_CALC;
-        mAmpere_seconds += current / F_POWER_CALC;
-    }
+uint32_t load_mAmpere_seconds()
+{
+    return load_charge() / CHARGE_PER_MAS;
+}
+
+void load_clear_counters()
+{
+    disableInterrupts();
+    load_energy_512pJ = 0;
+    load_charge_64nAs = 0;
+    load_int_energy_fraction = 0;
+    load_int_charge_fraction = 0;
+    enableInterrupts();
 }
 
 void load_timer()
 {
-    load_calc_power();
     // Load updates always run at maximum frequency
     load_update();
 }
@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "settings.h"
+#include "config.h"
 
 //NOTE: Keep this enum in sync with the messages in ui_error_handler()!
 typedef enum {
@@ -28,23 +29,75 @@ typedef enum {
     DISABLE_USER,
     DISABLE_ERROR,
     DISABLE_CUTOFF,
+    DISABLE_SEQUENCE, // step sequence finished (see seq.c)
+    DISABLE_BATTERY, // battery test finished (see batt.c)
+    DISABLE_SWEEP, // I-V sweep finished (see sweep.c)
+    DISABLE_TIME, // Run termination, same order as term_t (see term.c)
+    DISABLE_CHARGE,
+    DISABLE_ENERGY,
+    DISABLE_TEMPERATURE,
+    DISABLE_DVDT,
 } disable_reason_t;
 
 extern bool load_active;
 extern bool load_regulated;
+extern bool load_ramping; // Slew rate limit hasn't reached the mode's current yet
 extern uint8_t load_disable_reason;
 extern calibration_t calibration_step;
-extern uint16_t calibration_value;
+extern uint16_t calibration_value; // Raw PWM value in CAL_CURRENT
+
+typedef struct {
+    uint16_t current; // mA
+    uint16_t pwm;     // TIM1 CCR1
+} load_cal_point_t;
+extern load_cal_point_t load_cal[LOAD_CAL_POINTS];
 
 /* Current setpoint after all constraints are taken into account. */
 extern uint16_t current_setpoint;
-extern uint32_t mAmpere_seconds;
-extern uint32_t mWatt_seconds;
+/* Integrated at the ADC rate (see load_integrate()): energy in 512 pJ and
+   charge in 64 nAs. Read from the main loop, not from an IRQ. */
+uint64_t load_energy();
+uint64_t load_charge();
+#define ENERGY_PER_MWS 1953125UL
+#define ENERGY_PER_UWH 7031250UL
+#define CHARGE_PER_MAS 15625UL
+#define CHARGE_PER_UAH 56250UL
+uint32_t load_mWatt_seconds();
+uint32_t load_mAmpere_seconds();
+
+/* Result of the last pulse in MODE_DCIR */
+typedef struct {
+    uint16_t resistance; // mOhm, 0 = unknown
+    uint16_t v_base;     // mV before the pulse
+    uint16_t v_pulse;    // mV at the end of the pulse
+    uint16_t i_base;     // mA
+    uint16_t i_pulse;    // mA
+} dcir_result_t;
+extern dcir_result_t dcir_result;
+extern bool dcir_report; // Set after each pulse, cleared when printed
 
 
 void load_init();
 void load_timer();
 void load_enable();
 void load_disable(uint8_t reason);
+/* The load draws current. Stays set after load_disable() until the soft stop
+   (settings.ramp_rate) has finished, unlike load_active. */
+bool load_conducting();
+/* Thermal power limit in mW (see thermal.c), applied in all modes. */
+void load_set_power_derating(uint32_t power);
+/* Reset all integrated values. */
+void load_clear_counters();
+/* Load current calibration from EEPROM, use defaults if it's invalid. */
+void load_cal_init();
+/* Precompute the interpolation after load_cal was changed and use the new
+   table. Returns 0 and keeps the previous table if the breakpoints are not
+   sorted or the slope is out of range. */
+bool load_cal_apply();
+/* Store current calibration in EEPROM. */
+void load_cal_update();
+/* Fast control path, called from the ADC IRQ (see adc_fast_irq()).
+   voltage: input voltage, v_terminal: voltage at the load terminals (mV) */
+void load_fast_update(uint16_t voltage, uint16_t v_terminal);
 
 #endif
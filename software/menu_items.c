@@ -5,11 +5,17 @@
 
 const MenuItem menu_main;
     const MenuItem menu_run;
+    static const MenuItem menu_sequence;
     static const MenuItem menu_mode;
         static const MenuItem menu_mode_CC;
         static const MenuItem menu_mode_CV;
         static const MenuItem menu_mode_R;
         static const MenuItem menu_mode_P;
+        static const MenuItem menu_mode_TR;
+        static const MenuItem menu_mode_BAT;
+        static const MenuItem menu_mode_DCIR;
+        static const MenuItem menu_mode_SWEEP;
+        static const MenuItem menu_mode_MPPT;
     static const MenuItem menu_value;
     static const MenuItem menu_current_limit;
     static const MenuItem menu_settings;
@@ -17,7 +23,34 @@ const MenuItem menu_main;
         static const MenuItem menu_cutoff;
             static const MenuItem menu_cutoff_enabled;
             static const MenuItem menu_cutoff_value;
+            static const MenuItem menu_cutoff_debounce;
+            static const MenuItem menu_cutoff_compensation;
         static const MenuItem menu_max_power_action;
+        static const MenuItem menu_ovld_trip;
+        static const MenuItem menu_filter;
+            static const MenuItem menu_filter_load;
+            static const MenuItem menu_filter_sense;
+        static const MenuItem menu_sense;
+        static const MenuItem menu_ramp;
+        static const MenuItem menu_transient;
+            static const MenuItem menu_transient_high;
+            static const MenuItem menu_transient_low;
+            static const MenuItem menu_transient_freq;
+            static const MenuItem menu_transient_duty;
+        static const MenuItem menu_dcir;
+            static const MenuItem menu_dcir_base;
+            static const MenuItem menu_dcir_pulse;
+            static const MenuItem menu_dcir_time;
+        static const MenuItem menu_sweep;
+            static const MenuItem menu_sweep_max;
+            static const MenuItem menu_sweep_steps;
+            static const MenuItem menu_sweep_dwell;
+        static const MenuItem menu_term;
+            static const MenuItem menu_term_time;
+            static const MenuItem menu_term_charge;
+            static const MenuItem menu_term_energy;
+            static const MenuItem menu_term_temperature;
+            static const MenuItem menu_term_dvdt;
     static const MenuItem menu_info;
     static const MenuItem menu_clear_counters;
 
@@ -35,20 +68,20 @@ static const MenuItem menu_off = {
 const MenuItem menu_main = {
     .caption = "Main",
     .handler = &ui_submenu,
-    .subitems = { &menu_run, &menu_mode, &menu_value,  &menu_settings, &menu_clear_counters, &menu_info, 0}
+    .subitems = { &menu_run, &menu_sequence, &menu_mode, &menu_value,  &menu_settings, &menu_clear_counters, &menu_info, 0}
 };
 
 static const MenuItem menu_settings = {
     .caption = "...",
     .handler = &ui_submenu,
-    .subitems = { &menu_current_limit, &menu_cutoff, &menu_max_power_action, &menu_beep, 0}
+    .subitems = { &menu_current_limit, &menu_cutoff, &menu_max_power_action, &menu_ovld_trip, &menu_filter, &menu_sense, &menu_ramp, &menu_transient, &menu_dcir, &menu_sweep, &menu_term, &menu_beep, 0}
 };
 
 static const MenuItem menu_mode = {
     .caption = "MODE",
     .handler = &ui_select_item,
     .data = &settings.mode,
-    .subitems = {&menu_mode_CV,  &menu_mode_CC, &menu_mode_R, &menu_mode_P, 0}
+    .subitems = {&menu_mode_CV,  &menu_mode_CC, &menu_mode_R, &menu_mode_P, &menu_mode_TR, &menu_mode_BAT, &menu_mode_DCIR, &menu_mode_SWEEP, &menu_mode_MPPT, 0}
 };
 
 static const MenuItem menu_mode_CC = {
@@ -71,6 +104,31 @@ static const MenuItem menu_mode_P = {
     .value = MODE_CW
 };
 
+static const MenuItem menu_mode_TR = {
+    .caption = "TRA",
+    .value = MODE_TRANSIENT
+};
+
+static const MenuItem menu_mode_BAT = {
+    .caption = "BAT",
+    .value = MODE_BATTERY
+};
+
+static const MenuItem menu_mode_DCIR = {
+    .caption = "DCR",
+    .value = MODE_DCIR
+};
+
+static const MenuItem menu_mode_SWEEP = {
+    .caption = "SWP",
+    .value = MODE_SWEEP
+};
+
+static const MenuItem menu_mode_MPPT = {
+    .caption = "MPP",
+    .value = MODE_MPPT
+};
+
 const NumericEdit menu_value_edit_CC = {
     .var = &settings.setpoints[MODE_CC],
     .min = CUR_MIN,
@@ -99,6 +157,41 @@ const NumericEdit menu_value_edit_CW = {
     .dot_offset = POW_DOT_OFFSET,
 };
 
+const NumericEdit menu_value_edit_TR = {
+    .var = &settings.setpoints[MODE_TRANSIENT],
+    .min = CUR_MIN,
+    .max = CUR_MAX,
+    .dot_offset = CUR_DOT_OFFSET,
+};
+
+const NumericEdit menu_value_edit_BAT = {
+    .var = &settings.setpoints[MODE_BATTERY],
+    .min = CUR_MIN,
+    .max = CUR_MAX,
+    .dot_offset = CUR_DOT_OFFSET,
+};
+
+const NumericEdit menu_value_edit_DCIR = {
+    .var = &settings.setpoints[MODE_DCIR],
+    .min = CUR_MIN,
+    .max = CUR_MAX,
+    .dot_offset = CUR_DOT_OFFSET,
+};
+
+const NumericEdit menu_value_edit_SWEEP = {
+    .var = &settings.setpoints[MODE_SWEEP],
+    .min = CUR_MIN,
+    .max = CUR_MAX,
+    .dot_offset = CUR_DOT_OFFSET,
+};
+
+const NumericEdit menu_value_edit_MPPT = {
+    .var = &settings.setpoints[MODE_MPPT],
+    .min = CUR_MIN,
+    .max = CUR_MAX,
+    .dot_offset = CUR_DOT_OFFSET,
+};
+
 static const MenuItem menu_value = {
     .caption = "VAL ",
     .handler = &ui_edit_setpoint,
@@ -107,20 +200,22 @@ static const MenuItem menu_value = {
 static const MenuItem menu_beep = {
     .caption = "BEEP",
     .handler = &ui_select_item,
-    .data = &settings.beeper_enabled,
+    .data = &settings.flags,
+    .value = SETTINGS_BEEPER,
     .subitems = {&menu_on,  &menu_off,  0}
 };
 
 static const MenuItem menu_cutoff = {
     .caption = "CUTO",
     .handler = &ui_submenu,
-    .subitems = {&menu_cutoff_enabled, &menu_cutoff_value, 0}
+    .subitems = {&menu_cutoff_enabled, &menu_cutoff_value, &menu_cutoff_debounce, &menu_cutoff_compensation, 0}
 };
 
 static const MenuItem menu_cutoff_enabled = {
     .caption = "ENAB",
     .handler = &ui_select_item,
-    .data = &settings.cutoff_enabled,
+    .data = &settings.flags,
+    .value = SETTINGS_CUTOFF,
     .subitems = {&menu_on,  &menu_off,  0}
 };
 
@@ -138,6 +233,27 @@ static const MenuItem menu_cutoff_value = {
     .value = LED_V
 };
 
+static const NumericEdit menu_cutoff_debounce_edit = {
+    .var = &settings.batt_debounce,
+    .min = BATT_DEBOUNCE_MIN,
+    .max = BATT_DEBOUNCE_MAX,
+    .dot_offset = BATT_DEBOUNCE_DOT_OFFSET,
+};
+
+static const MenuItem menu_cutoff_debounce = {
+    .caption = "DEB ",
+    .handler = &ui_edit_value,
+    .data = &menu_cutoff_debounce_edit,
+};
+
+static const MenuItem menu_cutoff_compensation = {
+    .caption = "COMP",
+    .handler = &ui_select_item,
+    .data = &settings.flags,
+    .value = SETTINGS_BATT_COMPENSATION,
+    .subitems = {&menu_on,  &menu_off,  0}
+};
+
 static const NumericEdit menu_current_limit_edit = {
     .var = &settings.current_limit,
     .min = CUR_MIN,
@@ -164,12 +280,295 @@ static const MenuItem menu_max_power_action = {
     .subitems = {&menu_off,  &menu_lim,  0}
 };
 
+static const NumericEdit menu_ovld_trip_edit = {
+    .var = &settings.ovld_trip,
+    .min = 0,
+    .max = OVLD_TRIP_MAX,
+    .dot_offset = OVLD_TRIP_DOT_OFFSET,
+};
+
+static const MenuItem menu_ovld_trip = {
+    .caption = "OVLD",
+    .handler = &ui_edit_value,
+    .data = &menu_ovld_trip_edit,
+};
+
+static const MenuItem menu_filter = {
+    .caption = "FILT",
+    .handler = &ui_submenu,
+    .subitems = {&menu_filter_load, &menu_filter_sense, 0}
+};
+
+static const MenuItem menu_filter_load = {
+    .caption = "LOAD",
+    .handler = &ui_select_item,
+    .data = &settings.outlier_filter,
+    .value = 1 << ADC_CH_LOAD,
+    .subitems = {&menu_on,  &menu_off,  0}
+};
+
+static const MenuItem menu_filter_sense = {
+    .caption = "SENS",
+    .handler = &ui_select_item,
+    .data = &settings.outlier_filter,
+    .value = 1 << ADC_CH_SENSE,
+    .subitems = {&menu_on,  &menu_off,  0}
+};
+
+static const MenuItem menu_sense_auto = {
+    .caption = "AUTO",
+    .value = SENSE_AUTO
+};
+
+static const MenuItem menu_sense_local = {
+    .caption = "LOAD",
+    .value = SENSE_LOCAL
+};
+
+static const MenuItem menu_sense_remote = {
+    .caption = "SENS",
+    .value = SENSE_REMOTE
+};
+
+static const MenuItem menu_sense = {
+    .caption = "VSNS",
+    .handler = &ui_select_item,
+    .data = &settings.sense_mode,
+    .subitems = {&menu_sense_auto, &menu_sense_local, &menu_sense_remote, 0}
+};
+
+static const NumericEdit menu_ramp_edit = {
+    .var = &settings.ramp_rate,
+    .min = 0,
+    .max = RAMP_MAX,
+    .dot_offset = RAMP_DOT_OFFSET,
+};
+
+static const MenuItem menu_ramp = {
+    .caption = "RAMP",
+    .handler = &ui_edit_value,
+    .data = &menu_ramp_edit,
+    .value = LED_A,
+};
+
+static const MenuItem menu_transient = {
+    .caption = "TRAN",
+    .handler = &ui_submenu,
+    .subitems = {&menu_transient_high, &menu_transient_low, &menu_transient_freq, &menu_transient_duty, 0}
+};
+
+static const MenuItem menu_transient_high = {
+    .caption = "IHI ",
+    .handler = &ui_edit_value,
+    .data = &menu_value_edit_TR,
+    .value = LED_A,
+};
+
+static const NumericEdit menu_transient_low_edit = {
+    .var = &settings.transient_low,
+    .min = CUR_MIN,
+    .max = CUR_MAX,
+    .dot_offset = CUR_DOT_OFFSET,
+};
+
+static const MenuItem menu_transient_low = {
+    .caption = "ILO ",
+    .handler = &ui_edit_value,
+    .data = &menu_transient_low_edit,
+    .value = LED_A,
+};
+
+static const NumericEdit menu_transient_freq_edit = {
+    .var = &settings.transient_freq,
+    .min = TRANSIENT_FREQ_MIN,
+    .max = TRANSIENT_FREQ_MAX,
+    .dot_offset = TRANSIENT_FREQ_DOT_OFFSET,
+};
+
+static const MenuItem menu_transient_freq = {
+    .caption = "FREQ",
+    .handler = &ui_edit_value,
+    .data = &menu_transient_freq_edit,
+};
+
+static const NumericEdit menu_transient_duty_edit = {
+    .var = &settings.transient_duty,
+    .min = TRANSIENT_DUTY_MIN,
+    .max = TRANSIENT_DUTY_MAX,
+    .dot_offset = TRANSIENT_DUTY_DOT_OFFSET,
+};
+
+static const MenuItem menu_transient_duty = {
+    .caption = "DUTY",
+    .handler = &ui_edit_value,
+    .data = &menu_transient_duty_edit,
+};
+
+static const MenuItem menu_dcir = {
+    .caption = "DCIR",
+    .handler = &ui_submenu,
+    .subitems = {&menu_dcir_base, &menu_dcir_pulse, &menu_dcir_time, 0}
+};
+
+static const MenuItem menu_dcir_base = {
+    .caption = "IBAS",
+    .handler = &ui_edit_value,
+    .data = &menu_value_edit_DCIR,
+    .value = LED_A,
+};
+
+static const NumericEdit menu_dcir_pulse_edit = {
+    .var = &settings.dcir_pulse,
+    .min = CUR_MIN,
+    .max = CUR_MAX,
+    .dot_offset = CUR_DOT_OFFSET,
+};
+
+static const MenuItem menu_dcir_pulse = {
+    .caption = "IPUL",
+    .handler = &ui_edit_value,
+    .data = &menu_dcir_pulse_edit,
+    .value = LED_A,
+};
+
+static const NumericEdit menu_dcir_time_edit = {
+    .var = &settings.dcir_time,
+    .min = DCIR_TIME_MIN,
+    .max = DCIR_TIME_MAX,
+    .dot_offset = DCIR_TIME_DOT_OFFSET,
+};
+
+static const MenuItem menu_dcir_time = {
+    .caption = "TIME",
+    .handler = &ui_edit_value,
+    .data = &menu_dcir_time_edit,
+};
+
+static const MenuItem menu_sweep = {
+    .caption = "SWP ",
+    .handler = &ui_submenu,
+    .subitems = {&menu_sweep_max, &menu_sweep_steps, &menu_sweep_dwell, 0}
+};
+
+static const MenuItem menu_sweep_max = {
+    .caption = "IMAX",
+    .handler = &ui_edit_value,
+    .data = &menu_value_edit_SWEEP,
+    .value = LED_A,
+};
+
+static const NumericEdit menu_sweep_steps_edit = {
+    .var = &settings.sweep_steps,
+    .min = SWEEP_STEPS_MIN,
+    .max = SWEEP_STEPS_MAX,
+    .dot_offset = SWEEP_STEPS_DOT_OFFSET,
+};
+
+static const MenuItem menu_sweep_steps = {
+    .caption = "STEP",
+    .handler = &ui_edit_value,
+    .data = &menu_sweep_steps_edit,
+};
+
+static const NumericEdit menu_sweep_dwell_edit = {
+    .var = &settings.sweep_dwell,
+    .min = SWEEP_DWELL_MIN,
+    .max = SWEEP_DWELL_MAX,
+    .dot_offset = SWEEP_DWELL_DOT_OFFSET,
+};
+
+static const MenuItem menu_sweep_dwell = {
+    .caption = "DWEL",
+    .handler = &ui_edit_value,
+    .data = &menu_sweep_dwell_edit,
+};
+
+static const MenuItem menu_term = {
+    .caption = "TERM",
+    .handler = &ui_submenu,
+    .subitems = {&menu_term_time, &menu_term_charge, &menu_term_energy, &menu_term_temperature, &menu_term_dvdt, 0}
+};
+
+static const NumericEdit menu_term_time_edit = {
+    .var = &settings.term_limits[TERM_TIME],
+    .min = 0,
+    .max = TERM_TIME_MAX,
+    .dot_offset = TERM_TIME_DOT_OFFSET,
+};
+
+static const MenuItem menu_term_time = {
+    .caption = "TIME",
+    .handler = &ui_edit_value,
+    .data = &menu_term_time_edit,
+};
+
+static const NumericEdit menu_term_charge_edit = {
+    .var = &settings.term_limits[TERM_CHARGE],
+    .min = 0,
+    .max = TERM_CHARGE_MAX,
+    .dot_offset = TERM_CHARGE_DOT_OFFSET,
+};
+
+static const MenuItem menu_term_charge = {
+    .caption = "AH  ",
+    .handler = &ui_edit_value,
+    .data = &menu_term_charge_edit,
+    .value = LED_AH,
+};
+
+static const NumericEdit menu_term_energy_edit = {
+    .var = &settings.term_limits[TERM_ENERGY],
+    .min = 0,
+    .max = TERM_ENERGY_MAX,
+    .dot_offset = TERM_ENERGY_DOT_OFFSET,
+};
+
+static const MenuItem menu_term_energy = {
+    .caption = "WH  ",
+    .handler = &ui_edit_value,
+    .data = &menu_term_energy_edit,
+    .value = LED_WH,
+};
+
+static const NumericEdit menu_term_temperature_edit = {
+    .var = &settings.term_limits[TERM_TEMPERATURE],
+    .min = 0,
+    .max = TERM_TEMPERATURE_MAX,
+    .dot_offset = TERM_TEMPERATURE_DOT_OFFSET,
+};
+
+static const MenuItem menu_term_temperature = {
+    .caption = "TEMP",
+    .handler = &ui_edit_value,
+    .data = &menu_term_temperature_edit,
+};
+
+static const NumericEdit menu_term_dvdt_edit = {
+    .var = &settings.term_limits[TERM_DVDT],
+    .min = 0,
+    .max = TERM_DVDT_MAX,
+    .dot_offset = TERM_DVDT_DOT_OFFSET,
+};
+
+static const MenuItem menu_term_dvdt = {
+    .caption = "DVDT",
+    .handler = &ui_edit_value,
+    .data = &menu_term_dvdt_edit,
+    .value = LED_V,
+};
+
 const MenuItem menu_run = {
     .caption = "RUN ",
     .handler = &ui_run_mode,
     .subitems = {&menu_value, 0},
 };
 
+static const MenuItem menu_sequence = {
+    .caption = "SEQ ",
+    .handler = &ui_sequence_mode,
+    .subitems = {&menu_value, 0},
+};
+
 static const MenuItem menu_info = {
     .caption = "INFO",
     .handler = &ui_info_mode,
@@ -33,5 +33,10 @@ extern const NumericEdit menu_value_edit_CC;
 extern const NumericEdit menu_value_edit_CV;
 extern const NumericEdit menu_value_edit_CR;
 extern const NumericEdit menu_value_edit_CW;
+extern const NumericEdit menu_value_edit_TR;
+extern const NumericEdit menu_value_edit_BAT;
+extern const NumericEdit menu_value_edit_DCIR;
+extern const NumericEdit menu_value_edit_SWEEP;
+extern const NumericEdit menu_value_edit_MPPT;
 
 #endif
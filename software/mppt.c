@@ -0,0 +1,110 @@
+#include "mppt.h"
+#include "load.h"
+#include "adc.h"
+#include "settings.h"
+
+/* Maximum power point tracking (MODE_MPPT): Perturb and observe on the
+   current, limited to the setpoint. Every MPPT_PERIOD the power (voltage
+   averaged over the second half of the period) is compared with the previous
+   one. If it dropped, the direction is reversed and the step halved,
+   otherwise the step grows by 1/4. So the step is large while climbing
+   towards the maximum and shrinks to MPPT_STEP_MIN around it. An unregulated
+   period counts as zero power, because the current is unknown, and always
+   steps down. */
+uint16_t mppt_current = CUR_MIN;
+mppt_result_t mppt_result;
+bool mppt_report = 0;
+static bool mppt_running = 0;
+static bool mppt_down;
+static uint16_t mppt_step; // mA
+static uint32_t mppt_p_last;
+static uint8_t mppt_ticks;
+static uint32_t mppt_vsum;
+static bool mppt_unregulated;
+static uint32_t mppt_time; // systicks since the start
+static uint32_t mppt_p_sum; // Efficiency of the report interval
+static uint32_t mppt_p_max;
+static uint8_t mppt_p_count;
+
+static void mppt_start()
+{
+    mppt_running = 1;
+    mppt_down = 0;
+    mppt_step = MPPT_STEP_MAX;
+    mppt_p_last = 0;
+    mppt_ticks = 0;
+    mppt_vsum = 0;
+    mppt_unregulated = 0;
+    mppt_time = 0;
+    mppt_p_sum = 0;
+    mppt_p_max = 0;
+    mppt_p_count = 0;
+    mppt_result.converged = 0;
+}
+
+/* Next current from the power of the last period */
+static void mppt_perturb(uint32_t power)
+{
+    uint16_t current = current_setpoint; // Don't run away while limited
+    if (mppt_unregulated) {
+        // Above the short circuit current, speed up if it stays there
+        mppt_down = 1;
+        if (!mppt_p_last) mppt_step += mppt_step / 4;
+    } else if (power < mppt_p_last) {
+        mppt_down = !mppt_down;
+        mppt_step /= 2;
+    } else {
+        mppt_step += mppt_step / 4;
+    }
+    if (mppt_step < MPPT_STEP_MIN) mppt_step = MPPT_STEP_MIN;
+    if (mppt_step > MPPT_STEP_MAX) mppt_step = MPPT_STEP_MAX;
+    mppt_p_last = power;
+    if (mppt_step == MPPT_STEP_MIN && !mppt_result.converged) {
+        mppt_result.converged = mppt_time * (1000 / F_SYSTICK);
+    }
+    if (mppt_down) {
+        current = current > CUR_MIN + mppt_step ? current - mppt_step : CUR_MIN;
+    } else {
+        current += mppt_step;
+        if (current > settings.setpoints[MODE_MPPT]) current = settings.setpoints[MODE_MPPT];
+    }
+    mppt_current = current;
+}
+
+void mppt_timer()
+{
+    uint32_t power;
+    if (settings.mode != MODE_MPPT || !load_active) {
+        mppt_running = 0;
+        mppt_current = CUR_MIN;
+        return;
+    }
+    if (!mppt_running) mppt_start();
+    mppt_time++;
+
+    if (++mppt_ticks > MPPT_PERIOD / 2) {
+        mppt_vsum += adc_get_voltage();
+        if (!load_regulated) mppt_unregulated = 1;
+    }
+    if (mppt_ticks < MPPT_PERIOD) return;
+
+    mppt_result.current = current_setpoint;
+    mppt_result.voltage = mppt_vsum / (MPPT_PERIOD - MPPT_PERIOD / 2);
+    power = (uint32_t)mppt_result.current * mppt_result.voltage / 1000;
+    if (mppt_unregulated) power = 0;
+    mppt_result.power = power;
+    mppt_perturb(power);
+    mppt_ticks = 0;
+    mppt_vsum = 0;
+    mppt_unregulated = 0;
+
+    mppt_p_sum += power;
+    if (power > mppt_p_max) mppt_p_max = power;
+    if (++mppt_p_count == MPPT_REPORT_TIME * F_SYSTICK / MPPT_PERIOD) {
+        mppt_result.efficiency = mppt_p_max ? mppt_p_sum / mppt_p_count * 1000 / mppt_p_max : 0;
+        mppt_report = 1;
+        mppt_p_sum = 0;
+        mppt_p_max = 0;
+        mppt_p_count = 0;
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef _MPPT_H_
+#define _MPPT_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include "config.h"
+
+typedef struct {
+    uint16_t current;    // mA
+    uint16_t voltage;    // mV
+    uint32_t power;      // mW
+    uint16_t efficiency; // 0.1 %, average / maximum power of the last interval
+    uint32_t converged;  // ms from the start until the step size was minimal, 0 = not yet
+} mppt_result_t;
+
+/* Current requested from load_update() in MODE_MPPT */
+extern uint16_t mppt_current;
+extern mppt_result_t mppt_result;
+extern bool mppt_report; // Set every MPPT_REPORT_TIME, cleared when printed
+
+/* Called every systick from the main loop before load_timer(). */
+void mppt_timer();
+#endif
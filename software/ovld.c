@@ -0,0 +1,126 @@
+#include "ovld.h"
+#include "load.h"
+#include "settings.h"
+#include "systick.h"
+#include "inc/stm8s_gpio.h"
+
+/* Overload detection: The OL_DETECT edges interrupt on PORTC (shared with the
+   buttons), so even dropouts shorter than a systick are timestamped with the
+   TIM2 resolution. Only the time the load is switched on counts. Switching it
+   on or off doesn't cause an edge, ovld_timer() catches up on that.
+   The IRQ only adds the raw timestamp differences, ovld_timer() converts them.
+   settings.ovld_trip sets ERROR_OVERLOAD when a single dropout lasts longer. */
+uint16_t ovld_events = 0;
+uint32_t ovld_unregulated_ms = 0;
+ovld_dropout_t ovld_dropout;
+bool ovld_report = 0;
+static bool ovld_lost = 0;
+static bool ovld_done = 0; // Dropout finished, ovld_last/ovld_end are valid
+static systick_timestamp_t ovld_start; // Loss of regulation
+static systick_timestamp_t ovld_last; // Loss of regulation of the finished dropout
+static systick_timestamp_t ovld_end; // Regain
+static systick_timestamp_t ovld_mark; // Start of the time not added to the sums yet
+static uint32_t ovld_sum_ticks; // Unregulated time not converted yet: systicks ...
+static int32_t ovld_sum_counts; // ... plus TIM2 counts (may be negative)
+static uint32_t ovld_remainder; // us below 1 ms
+
+/* Interrupts must be disabled */
+static void ovld_add(const systick_timestamp_t *now)
+{
+    ovld_sum_ticks += now->tick - ovld_mark.tick;
+    ovld_sum_counts += (int32_t)now->count - ovld_mark.count;
+    ovld_mark = *now;
+}
+
+/* Interrupts must be disabled */
+static void ovld_update(bool lost)
+{
+    systick_timestamp_t now;
+    if (lost == ovld_lost) return;
+    systick_timestamp(&now);
+    if (lost) {
+        ovld_start = now;
+        ovld_mark = now;
+        ovld_events++;
+    } else {
+        ovld_add(&now);
+        ovld_last = ovld_start;
+        ovld_end = now;
+        ovld_done = 1;
+    }
+    ovld_lost = lost;
+}
+
+static inline bool ovld_unregulated(uint8_t port)
+{
+    return !(port & PINC_OL_DETECT) && !(GPIOE->ODR & PINE_ENABLE);
+}
+
+void ovld_irq(uint8_t port)
+{
+    ovld_update(ovld_unregulated(port));
+}
+
+static uint32_t ovld_ms(const systick_timestamp_t *t)
+{
+    return t->tick * (1000 / F_SYSTICK) + t->count / (SYSTICK_COUNTS_PER_US * 1000);
+}
+
+/* Saturates after 71 minutes */
+static uint32_t ovld_us(uint32_t ticks, int32_t counts)
+{
+    if (ticks >= UINT32_MAX / (1000000 / F_SYSTICK) - 1) return UINT32_MAX;
+    return ticks * (1000000 / F_SYSTICK) + counts / SYSTICK_COUNTS_PER_US;
+}
+
+void ovld_timer()
+{
+    systick_timestamp_t now, start, end;
+    uint32_t ticks, open_ticks = 0;
+    int32_t counts, open_counts = 0;
+    bool done;
+
+    disableInterrupts();
+    ovld_update(ovld_unregulated(GPIOC->IDR));
+    if (ovld_lost) {
+        systick_timestamp(&now);
+        ovld_add(&now);
+        open_ticks = now.tick - ovld_start.tick;
+        open_counts = (int32_t)now.count - ovld_start.count;
+    }
+    ticks = ovld_sum_ticks;
+    counts = ovld_sum_counts;
+    ovld_sum_ticks = 0;
+    ovld_sum_counts = 0;
+    done = ovld_done;
+    start = ovld_last;
+    end = ovld_end;
+    ovld_done = 0;
+    enableInterrupts();
+
+    ovld_remainder += ovld_us(ticks, counts);
+    ovld_unregulated_ms += ovld_remainder / 1000;
+    ovld_remainder %= 1000;
+    if (done) {
+        // Only the last one if several finished within this systick
+        ovld_dropout.loss = ovld_ms(&start);
+        ovld_dropout.regain = ovld_ms(&end);
+        ovld_dropout.duration = ovld_us(end.tick - start.tick, (int32_t)end.count - start.count);
+        ovld_report = 1;
+    }
+    if (settings.ovld_trip && ovld_us(open_ticks, open_counts) >= (uint32_t)settings.ovld_trip * 1000) {
+        error = ERROR_OVERLOAD;
+    }
+}
+
+void ovld_clear()
+{
+    disableInterrupts();
+    ovld_events = 0;
+    ovld_unregulated_ms = 0;
+    ovld_remainder = 0;
+    ovld_sum_ticks = 0;
+    ovld_sum_counts = 0;
+    if (ovld_lost) systick_timestamp(&ovld_mark);
+    enableInterrupts();
+}
@@ -0,0 +1,24 @@
+#ifndef _OVLD_H_
+#define _OVLD_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include "config.h"
+
+typedef struct {
+    uint32_t loss;     // ms since power on
+    uint32_t regain;   // ms since power on
+    uint32_t duration; // us
+} ovld_dropout_t;
+
+extern uint16_t ovld_events;          // Losses of regulation
+extern uint32_t ovld_unregulated_ms;  // Sum of all dropouts
+extern ovld_dropout_t ovld_dropout;   // Last finished dropout
+extern bool ovld_report;              // Set after each dropout, cleared when printed
+
+/* Called from ui_button_irq() with GPIOC->IDR on every edge of PORTC. */
+void ovld_irq(uint8_t port);
+/* Called every systick from the main loop before load_timer(). */
+void ovld_timer();
+/* Reset the events and the unregulated time. */
+void ovld_clear();
+#endif
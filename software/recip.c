@@ -0,0 +1,99 @@
+/* Division free reciprocals for the control loop. The STM8 only divides
+   16 bit numbers in hardware, SDCC's 32 bit division is a slow software loop.
+   Multiplications are much cheaper, so 1/x is a table lookup refined by one
+   Newton step. Values that rarely change (setpoints) use recip_div(). */
+#include "recip.h"
+
+/* recip_table[i] = 2^31 / (32768 + 256 * i + 128), i.e. the reciprocal of the
+   middle of each interval. Max. relative error 1/256 => ~2^-16 after Newton. */
+static const uint16_t recip_table[128] = {
+    65281, 64777, 64281, 63792, 63310, 62836, 62369, 61909,
+    61455, 61008, 60568, 60133, 59705, 59283, 58867, 58457,
+    58053, 57654, 57260, 56872, 56489, 56111, 55738, 55370,
+    55007, 54649, 54295, 53946, 53601, 53261, 52925, 52593,
+    52265, 51942, 51622, 51306, 50995, 50686, 50382, 50081,
+    49784, 49490, 49200, 48913, 48630, 48349, 48072, 47798,
+    47528, 47260, 46995, 46733, 46474, 46218, 45965, 45714,
+    45467, 45222, 44979, 44739, 44502, 44267, 44035, 43805,
+    43577, 43352, 43129, 42908, 42690, 42474, 42260, 42048,
+    41838, 41631, 41425, 41222, 41020, 40820, 40623, 40427,
+    40233, 40041, 39851, 39662, 39476, 39291, 39108, 38926,
+    38746, 38568, 38392, 38217, 38044, 37872, 37702, 37533,
+    37366, 37200, 37036, 36873, 36712, 36552, 36393, 36236,
+    36080, 35926, 35772, 35620, 35470, 35320, 35172, 35026,
+    34880, 34735, 34592, 34450, 34309, 34169, 34031, 33893,
+    33757, 33622, 33487, 33354, 33222, 33091, 32961, 32832,
+};
+
+recip_t recip_from(uint32_t x)
+{
+    recip_t r = {0, 0};
+    if (!x) return r;
+    while (x > 0xffff) {
+        x >>= 1;
+        r.e++;
+    }
+    while (!(x & 0x8000)) {
+        x <<= 1;
+        r.e--;
+    }
+    r.m = x;
+    return r;
+}
+
+recip_t recip_div(uint32_t num, uint16_t den)
+{
+    uint8_t shift = 0;
+    recip_t r;
+    if (!den) {
+        r.m = 0xffff;
+        r.e = RECIP_E_MAX;
+        return r;
+    }
+    // Scale num to at least 2^16 * den => 16 significant bits in the quotient
+    while (num && num < 0x80000000UL) {
+        num <<= 1;
+        shift++;
+    }
+    r = recip_from(num / den);
+    r.e -= shift;
+    return r;
+}
+
+recip_t recip_inv(uint16_t x)
+{
+    recip_t r;
+    uint16_t y;
+    int32_t d;
+    int8_t s = 0;
+
+    if (!x) {
+        r.m = 0xffff;
+        r.e = RECIP_E_MAX;
+        return r;
+    }
+    while (!(x & 0x8000)) {
+        x <<= 1;
+        s++;
+    }
+    // x in [2^15, 2^16) => y ~ 2^31 / x in (2^15, 2^16]
+    y = recip_table[(x >> 8) & 0x7f];
+    // Newton: y' = y + y * (2^31 - x * y) / 2^31
+    d = (int32_t)(0x80000000UL - (uint32_t)x * y) >> 9;
+    d = y + (((int32_t)y * d) >> 22);
+    r.m = d > 0xffff ? 0xffff : d;
+    r.e = s - 31;
+    return r;
+}
+
+uint16_t recip_mul(recip_t a, recip_t b)
+{
+    uint32_t p = (uint32_t)a.m * b.m;
+    int8_t e = a.e + b.e;
+    if (!p) return 0;
+    if (e >= 0) return 0xffff; // p >= 2^30
+    if (e <= -32) return 0;
+    p = (p >> (-e - 1)) + 1; // Round to nearest
+    p >>= 1;
+    return p > 0xffff ? 0xffff : p;
+}
@@ -0,0 +1,20 @@
+#ifndef _RECIP_H_
+#define _RECIP_H_
+#include <stdint.h>
+
+/* value = m * 2^e, m is normalized (bit 15 set) or 0 */
+typedef struct {
+    uint16_t m;
+    int8_t e;
+} recip_t;
+#define RECIP_E_MAX 16 // Used for 1/0
+
+recip_t recip_from(uint32_t x);
+/* num / den with a 32 bit division, for cached values */
+recip_t recip_div(uint32_t num, uint16_t den);
+/* 1 / x without division */
+recip_t recip_inv(uint16_t x);
+/* a * b rounded to an integer, saturates at 0xffff */
+uint16_t recip_mul(recip_t a, recip_t b);
+
+#endif
@@ -0,0 +1,168 @@
+/* Host replay of recorded ADC streams through adc_irq() and adc_timer().
+   Not part of the firmware, build with "make replay-adc".
+
+   Usage: replay_adc [-n scans] [-f] [-b runs] file
+   file: One scan per line "temperature,load,sense,12v" with raw right aligned
+         10 bit values (.csv) or 4 little endian uint16_t per scan (any other
+         extension).
+   -n: Scans per systick (default 670, see adc_init())
+   -f: Enable the outlier filter for all channels
+   -b: Benchmark: replay the file runs times without output and print the
+       host time per adc_irq() and per adc_timer() call.
+
+   Output: One line per systick "tick,error,temperature,v_12V,v_load,v_sense".
+
+   Note: int is 32 bit on the host and 16 bit on the STM8. Results only
+   match the firmware as long as adc.c doesn't depend on 16 bit overflows. */
+
+#include "adc.h"
+#include "load.h"
+#include "settings.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+void adc_irq();
+
+typedef struct {
+    uint16_t raw[ADC_NUM_CHANNELS];
+} scan_t;
+
+static scan_t *load_file(const char *name, size_t *n)
+{
+    FILE *f = fopen(name, "rb");
+    size_t len = strlen(name);
+    bool csv = len > 4 && strcmp(name + len - 4, ".csv") == 0;
+    size_t size = 1024;
+    scan_t *scans = malloc(size * sizeof(scan_t));
+    char line[128];
+
+    if (!f || !scans) {
+        perror(name);
+        exit(1);
+    }
+    *n = 0;
+    while (1) {
+        scan_t *s;
+        if (*n == size) {
+            size *= 2;
+            scans = realloc(scans, size * sizeof(scan_t));
+            if (!scans) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        s = &scans[*n];
+        if (csv) {
+            unsigned t, l, v, p;
+            if (!fgets(line, sizeof(line), f)) break;
+            if (sscanf(line, "%u,%u,%u,%u", &t, &l, &v, &p) != 4) continue; // Header, comments
+            s->raw[ADC_CH_TEMPERATURE] = t;
+            s->raw[ADC_CH_LOAD] = l;
+            s->raw[ADC_CH_SENSE] = v;
+            s->raw[ADC_CH_12V] = p;
+        } else {
+            uint8_t b[2 * ADC_NUM_CHANNELS];
+            if (fread(b, sizeof(b), 1, f) != 1) break;
+            for (uint8_t i = 0; i < ADC_NUM_CHANNELS; i++) {
+                s->raw[i] = b[2 * i] | (b[2 * i + 1] << 8);
+            }
+        }
+        for (uint8_t i = 0; i < ADC_NUM_CHANNELS; i++) {
+            s->raw[i] &= 0x3ff;
+        }
+        (*n)++;
+    }
+    fclose(f);
+    return scans;
+}
+
+/* Emulates one scan: data registers, analog watchdog and TIM4 timestamps. */
+static void replay_scan(const scan_t *s)
+{
+    uint16_t ltr = (host_adc1.LTRH << 2) | host_adc1.LTRL;
+    uint16_t htr = (host_adc1.HTRH << 2) | host_adc1.HTRL;
+    uint16_t load = s->raw[ADC_CH_LOAD];
+
+    // adc_irq() reads each register pair as uint16_t => store in host byte order
+    memcpy((void *)&host_adc1.DB0RH, s->raw, sizeof(s->raw));
+    host_adc1.CSR |= ADC1_CSR_EOC;
+    if (load < ltr || load > htr) {
+        host_adc1.CSR |= ADC1_CSR_AWD;
+        host_adc1.AWSRL |= 1 << ADC_CH_LOAD;
+    }
+    host_tim4.CNTR += 25;
+    adc_irq();
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned scans_per_tick = 670;
+    unsigned runs = 0;
+    bool filter = 0;
+    scan_t *scans;
+    size_t n;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:fb:")) != -1) {
+        switch (opt) {
+            case 'n': scans_per_tick = atoi(optarg); break;
+            case 'f': filter = 1; break;
+            case 'b': runs = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n scans] [-f] [-b runs] file\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1 || scans_per_tick == 0) {
+        fprintf(stderr, "Usage: %s [-n scans] [-f] [-b runs] file\n", argv[0]);
+        return 1;
+    }
+    scans = load_file(argv[optind], &n);
+
+    memset(&settings, 0, sizeof(settings));
+    settings.outlier_filter = filter ? (1 << ADC_NUM_CHANNELS) - 1 : 0;
+    adc_init();
+
+    if (runs) {
+        double t_irq = 0, t_timer = 0;
+        unsigned long ticks = 0;
+        for (unsigned r = 0; r < runs; r++) {
+            for (size_t i = 0; i < n; i += scans_per_tick) {
+                size_t end = i + scans_per_tick < n ? i + scans_per_tick : n;
+                double t0 = now();
+                for (size_t j = i; j < end; j++) {
+                    replay_scan(&scans[j]);
+                }
+                double t1 = now();
+                adc_timer();
+                t_timer += now() - t1;
+                t_irq += t1 - t0;
+                ticks++;
+            }
+        }
+        printf("adc_irq: %.1f ns/scan\n", t_irq * 1e9 / ((double)n * runs));
+        printf("adc_timer: %.1f ns/systick\n", t_timer * 1e9 / ticks);
+    } else {
+        unsigned long tick = 0;
+        printf("tick,error,temperature,v_12V,v_load,v_sense\n");
+        for (size_t i = 0; i + scans_per_tick <= n; i += scans_per_tick) {
+            for (size_t j = i; j < i + scans_per_tick; j++) {
+                replay_scan(&scans[j]);
+            }
+            adc_timer();
+            printf("%lu,%d,%u,%u,%u,%u\n", tick++, error, temperature, v_12V, v_load, v_sense);
+        }
+    }
+    free(scans);
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include "seq.h"
+#include "load.h"
+#include "adc.h"
+#include "settings.h"
+
+/* Step sequencer: Each step sets the mode and its setpoint and ends after
+   its duration or when its exit condition is met, whichever comes first.
+   The load is switched off after the last step (DISABLE_SEQUENCE). Runs
+   every systick before load_timer(), so the timing is exact to one systick.
+   The user's mode and setpoints are restored when the sequence stops. */
+seq_t seq;
+uint8_t seq_step = 0;
+uint16_t seq_time;
+static uint8_t seq_subtick;
+static bool seq_first_tick; // current_setpoint and the voltage are the previous step's
+static uint8_t seq_saved_mode;
+static uint16_t seq_saved_setpoints[NUM_MODES];
+
+_Static_assert(sizeof(seq) < 128, "sequence doesn't fit into one flash block");
+#if F_SYSTICK % 10 != 0
+    #error "seq_time needs F_SYSTICK to be a multiple of 10 Hz"
+#endif
+
+void seq_init()
+{
+    if (!flash_read_block(SEQ_FLASH, &seq, sizeof(seq)) || !seq_valid()) {
+        seq.count = 0;
+    }
+}
+
+bool seq_update()
+{
+    if (!seq_valid()) return 0;
+    flash_write_block(SEQ_FLASH, &seq, sizeof(seq));
+    return 1;
+}
+
+bool seq_valid()
+{
+    if (seq.count > SEQ_MAX_STEPS) return 0;
+    for (uint8_t i = 0; i < seq.count; i++) {
+        const seq_step_t *s = &seq.steps[i];
+        uint16_t min, max;
+        switch (s->mode) {
+            case MODE_CC:
+            case MODE_TRANSIENT:
+            case MODE_BATTERY:
+            case MODE_DCIR:
+            case MODE_SWEEP:
+            case MODE_MPPT:
+                min = CUR_MIN;
+                max = CUR_MAX;
+                break;
+            case MODE_CW:
+                min = POW_MIN;
+                max = POW_MAX;
+                break;
+            case MODE_CR:
+                min = R_MIN;
+                max = R_MAX;
+                break;
+            case MODE_CV:
+                min = VOLT_MIN;
+                max = VOLT_MAX;
+                break;
+            default:
+                return 0;
+        }
+        if (s->setpoint < min || s->setpoint > max || s->exit >= NUM_SEQ_EXIT) return 0;
+        if (!s->duration && s->exit == SEQ_EXIT_NONE) return 0; // Would never end
+    }
+    return 1;
+}
+
+static void seq_next()
+{
+    const seq_step_t *s;
+    if (seq_step == seq.count) {
+        seq_stop();
+        load_disable(DISABLE_SEQUENCE);
+        return;
+    }
+    s = &seq.steps[seq_step++];
+    settings.mode = s->mode;
+    settings.setpoints[s->mode] = s->setpoint;
+    seq_time = 0;
+    seq_subtick = 0;
+    seq_first_tick = 1;
+}
+
+bool seq_start()
+{
+    if (!seq.count || !seq_valid()) return 0;
+    if (!seq_step) {
+        seq_saved_mode = settings.mode;
+        for (uint8_t i = 0; i < NUM_MODES; i++) {
+            seq_saved_setpoints[i] = settings.setpoints[i];
+        }
+    }
+    seq_step = 0;
+    seq_next();
+    return 1;
+}
+
+void seq_stop()
+{
+    if (!seq_step) return;
+    seq_step = 0;
+    settings.mode = seq_saved_mode;
+    for (uint8_t i = 0; i < NUM_MODES; i++) {
+        settings.setpoints[i] = seq_saved_setpoints[i];
+    }
+}
+
+static bool seq_exit(const seq_step_t *s)
+{
+    uint16_t voltage = adc_get_voltage();
+    switch (s->exit) {
+        case SEQ_EXIT_V_BELOW: return voltage < s->exit_value;
+        case SEQ_EXIT_V_ABOVE: return voltage > s->exit_value;
+        // Not while a soft start or the slew rate limit still moves the current
+        case SEQ_EXIT_I_BELOW: return !load_ramping && current_setpoint < s->exit_value;
+        case SEQ_EXIT_I_ABOVE: return !load_ramping && current_setpoint > s->exit_value;
+    }
+    return 0;
+}
+
+void seq_timer()
+{
+    const seq_step_t *s;
+    if (!seq_step) return;
+    if (!load_active) {
+        // Stopped by the user, cutoff or an error
+        seq_stop();
+        return;
+    }
+    s = &seq.steps[seq_step - 1];
+    if (++seq_subtick == F_SYSTICK / 10) {
+        seq_subtick = 0;
+        seq_time++;
+    }
+    if (s->duration && seq_time >= s->duration) {
+        seq_next();
+    } else if (seq_first_tick) {
+        seq_first_tick = 0; // load_timer() applies the step after this
+    } else if (seq_exit(s)) {
+        seq_next();
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef _SEQ_H_
+#define _SEQ_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include "config.h"
+
+typedef enum {
+    SEQ_EXIT_NONE,    // Only the duration ends the step
+    SEQ_EXIT_V_BELOW, // Voltage < exit_value (mV)
+    SEQ_EXIT_V_ABOVE, // Voltage > exit_value (mV)
+    SEQ_EXIT_I_BELOW, // Current < exit_value (mA)
+    SEQ_EXIT_I_ABOVE, // Current > exit_value (mA)
+    NUM_SEQ_EXIT
+} seq_exit_t;
+
+typedef struct {
+    uint16_t duration;   // 0.1 s, 0 = until the exit condition is met
+    uint8_t mode;        // sink_mode_t
+    uint8_t exit;        // seq_exit_t
+    uint16_t setpoint;   // Unit of settings.setpoints[mode]
+    uint16_t exit_value;
+} seq_step_t;
+
+typedef struct {
+    uint8_t count; // Number of steps
+    seq_step_t steps[SEQ_MAX_STEPS];
+} seq_t;
+
+extern seq_t seq;
+extern uint8_t seq_step;  // Running step + 1, 0 = stopped
+extern uint16_t seq_time; // Time in the running step (0.1 s)
+
+/* Load the sequence from flash, empty sequence if it's invalid. */
+void seq_init();
+/* Store the sequence in flash. Returns 0 if a step is invalid. */
+bool seq_update();
+/* Returns 0 if a step is invalid. */
+bool seq_valid();
+/* Prepare the first step. The caller enables the load, the sequence runs
+   as long as the load is active. Returns 0 if the sequence is empty or invalid. */
+bool seq_start();
+void seq_stop();
+/* Called every systick from the main loop before load_timer(). */
+void seq_timer();
+#endif
@@ -17,6 +17,12 @@ void eeprom_write(uint16_t address, uint8_t data) {
     _MEM_(address + FLASH_DATA_START_PHYSICAL_ADDRESS) = data;
 }
 
+/* Program memory, address is absolute. The CPU stalls during each write. */
+static void flash_write(uint16_t address, uint8_t data) {
+    if (_MEM_(address) == data) return;
+    _MEM_(address) = data;
+}
+
 
 /* Note: The checksum is placed after the data so when the settings size grows
    The checksum automatically becomes invalid. */
@@ -32,44 +38,111 @@ static uint8_t settings_calc_checksum(uint8_t *data, uint16_t size)
     return checksum;
 }
 
-void settings_init()
+/* Read a block followed by its checksum. Returns 0 if the checksum is invalid. */
+bool eeprom_read_block(uint16_t address, void *block, uint16_t size)
+{
+    uint16_t i;
+    uint8_t *data = (uint8_t*)block;
+    for (i = 0; i < size; i++)
+    {
+        data[i] = eeprom_read(address + i);
+    }
+    uint8_t checksum = eeprom_read(address + size);
+    return checksum == settings_calc_checksum(data, size);
+}
+
+/* Write a block followed by its checksum. */
+void eeprom_write_block(uint16_t address, void *block, uint16_t size)
 {
-    uint16_t addr;
-    uint8_t *data = (uint8_t*)(&settings);
-    for (addr = 0; addr < sizeof(settings); addr++)
+    uint16_t i;
+    uint8_t *data = (uint8_t*)block;
+    for (i = 0; i < size; i++)
     {
-        data[addr] = eeprom_read(addr);
+        eeprom_write(address + i, data[i]);
     }
-    uint8_t checksum = eeprom_read(sizeof(settings));
-    if (checksum != settings_calc_checksum(data, sizeof(settings))) {
+    eeprom_write(address + size, settings_calc_checksum(data, size));
+    /* TODO: Writing the EEPROM can take several 10s of milliseconds. This leads
+    to timer overflow errors. As EEPROM writes only happen while the load is
+    inactive this should be no problem and we simply delete the error flags.
+    However in the future this write function could be split into smaller parts
+    */
+    systick_flag &= ~(SYSTICK_OVERFLOW|SYSTICK_COUNT);
+}
+
+/* Same as eeprom_read_block() for the program memory (absolute address). */
+bool flash_read_block(uint16_t address, void *block, uint16_t size)
+{
+    uint16_t i;
+    uint8_t *data = (uint8_t*)block;
+    for (i = 0; i < size; i++)
+    {
+        data[i] = _MEM_(address + i);
+    }
+    return _MEM_(address + size) == settings_calc_checksum(data, size);
+}
+
+/* Same as eeprom_write_block() for the program memory (absolute address).
+   Program memory is only unlocked while writing. It is only guaranteed for
+   100 write cycles, so an unchanged block is not written again. */
+void flash_write_block(uint16_t address, void *block, uint16_t size)
+{
+    uint16_t i;
+    uint8_t *data = (uint8_t*)block;
+    for (i = 0; i < size && _MEM_(address + i) == data[i]; i++);
+    if (i == size && _MEM_(address + size) == settings_calc_checksum(data, size)) return;
+    FLASH->PUKR = FLASH_RASS_KEY1;
+    FLASH->PUKR = FLASH_RASS_KEY2;
+    while (!(FLASH->IAPSR & FLASH_IAPSR_PUL));
+    for (i = 0; i < size; i++)
+    {
+        flash_write(address + i, data[i]);
+    }
+    flash_write(address + size, settings_calc_checksum(data, size));
+    FLASH->IAPSR &= ~FLASH_IAPSR_PUL;
+    systick_flag &= ~(SYSTICK_OVERFLOW|SYSTICK_COUNT); // See eeprom_write_block()
+}
+
+_Static_assert(sizeof(settings_t) < EEPROM_SETTINGS_SIZE, "settings don't fit into EEPROM");
+
+void settings_init()
+{
+    if (!eeprom_read_block(EEPROM_SETTINGS, &settings, sizeof(settings))) {
         // Invalid checksum => initialize default values
         settings.mode = MODE_CC;
+        settings.flags = SETTINGS_BEEPER;
         settings.setpoints[MODE_CC] = 1000;
         settings.setpoints[MODE_CW] = 30000;
         settings.setpoints[MODE_CR] = 50000;
         settings.setpoints[MODE_CV] = 10000;
-        settings.beeper_enabled = 1;
-        settings.cutoff_enabled = 0;
+        settings.setpoints[MODE_TRANSIENT] = 2000;
+        settings.setpoints[MODE_BATTERY] = 1000;
+        settings.setpoints[MODE_DCIR] = 1000;
+        settings.setpoints[MODE_SWEEP] = CUR_MAX;
+        settings.setpoints[MODE_MPPT] = CUR_MAX;
         settings.cutoff_voltage = 3300;
         settings.current_limit = CUR_MAX;
         settings.max_power_action = MAX_P_LIM;
+        settings.outlier_filter = 0;
+        settings.sense_mode = SENSE_AUTO;
+        settings.cv_kp = CV_KP_DEFAULT;
+        settings.cv_ki = CV_KI_DEFAULT;
+        settings.transient_low = 500;
+        settings.transient_freq = 10;
+        settings.transient_duty = 50;
+        settings.ramp_rate = 0;
+        settings.batt_debounce = 20;
+        settings.dcir_pulse = 3000;
+        settings.dcir_time = 10;
+        settings.sweep_steps = 50;
+        settings.sweep_dwell = 20;
+        for (uint8_t i = 0; i < NUM_TERM; i++) {
+            settings.term_limits[i] = 0;
+        }
+        settings.ovld_trip = 0;
     }
 }
 
 void settings_update()
 {
-    uint16_t addr;
-    uint8_t *data = (uint8_t*)(&settings);
-    for (addr = 0; addr < sizeof(settings); addr++)
-    {
-        eeprom_write(addr, data[addr]);
-    }
-    uint8_t checksum = settings_calc_checksum(data, sizeof(settings));
-    eeprom_write(sizeof(settings), checksum);
-    /* TODO: Writing the EEPROM can take several 10s of milliseconds. This leads
-    to timer overflow errors. As EEPROM writes only happen while the load is
-    inactive this should be no problem and we simply delete the error flags.
-    However in the future this write function could be split into smaller parts
-    */
-    systick_flag &= ~(SYSTICK_OVERFLOW|SYSTICK_COUNT);
+    eeprom_write_block(EEPROM_SETTINGS, &settings, sizeof(settings));
 }
@@ -2,12 +2,18 @@
 #define _SETTINGS_H_
 #include <stdbool.h>
 #include <stdint.h>
+#include "config.h"
 
 typedef enum {
     MODE_CC,
     MODE_CW,
     MODE_CR,
     MODE_CV,
+    MODE_TRANSIENT,
+    MODE_BATTERY, // CC with battery test termination (see batt.c)
+    MODE_DCIR, // Base current with periodic pulses (see load.c)
+    MODE_SWEEP, // I-V sweep (see sweep.c)
+    MODE_MPPT, // Maximum power point tracking (see mppt.c)
     NUM_MODES
 } sink_mode_t;
 
@@ -16,18 +22,57 @@ typedef enum {
     MAX_P_LIM = 1,
 } max_power_action_t;
 
+typedef enum {
+    SENSE_AUTO = 0,   // Use v_sense when the sense leads are connected
+    SENSE_LOCAL = 1,  // Always use v_load
+    SENSE_REMOTE = 2, // Always use v_sense
+} sense_mode_t;
+
+typedef enum {
+    TERM_TIME,        // 0.01 h since the load was enabled
+    TERM_CHARGE,      // mAh
+    TERM_ENERGY,      // 10 mWh
+    TERM_TEMPERATURE, // 0.1°C
+    TERM_DVDT,        // Voltage drop in mV/min
+    NUM_TERM
+} term_t;
+
+/* Bits of settings_t.flags */
+#define SETTINGS_BEEPER 0x01
+#define SETTINGS_CUTOFF 0x02 // Cutoff voltage enabled
+#define SETTINGS_BATT_COMPENSATION 0x04 // Compensate the internal resistance (see batt.c)
+
 typedef struct {
-    sink_mode_t mode;
-    uint16_t setpoints[NUM_MODES]; // CC (mA)/CW(mW)/CR/CV(mV)
-    bool beeper_enabled;
-    bool cutoff_enabled;
+    uint8_t mode; // sink_mode_t
+    uint8_t flags; // SETTINGS_*
+    uint16_t setpoints[NUM_MODES]; // CC (mA)/CW(mW)/CR/CV(mV)/transient high level/battery/DCIR base/sweep end/MPPT max. (mA)
     uint16_t cutoff_voltage; //mV
     uint16_t current_limit; //mA
     uint8_t max_power_action;
+    uint8_t outlier_filter; // Bitmask of channels that clamp ADC spikes, see adc.c
+    uint8_t sense_mode;
+    uint16_t cv_kp; // CV controller gains, Q8 (see load.c)
+    uint16_t cv_ki;
+    uint16_t transient_low; // mA
+    uint16_t transient_freq; // 0.1 Hz
+    uint16_t transient_duty; // % of the period at the high level
+    uint16_t ramp_rate; // mA/s, 0 = off (see load.c)
+    uint16_t batt_debounce; // 0.1 s below the cutoff voltage ends a battery test
+    uint16_t dcir_pulse; // mA
+    uint16_t dcir_time; // 10 ms
+    uint16_t sweep_steps; // Number of points
+    uint16_t sweep_dwell; // 10 ms per point
+    uint16_t term_limits[NUM_TERM]; // 0 = off (see term.c)
+    uint16_t ovld_trip; // ms unregulated until ERROR_OVERLOAD, 0 = off (see ovld.c)
 } settings_t;
 
 extern settings_t settings;
 
 void settings_init();
 void settings_update();
+
+bool eeprom_read_block(uint16_t address, void *block, uint16_t size);
+void eeprom_write_block(uint16_t address, void *block, uint16_t size);
+bool flash_read_block(uint16_t address, void *block, uint16_t size);
+void flash_write_block(uint16_t address, void *block, uint16_t size);
 #endif
@@ -0,0 +1,89 @@
+#include "sweep.h"
+#include "load.h"
+#include "adc.h"
+#include "settings.h"
+
+/* I-V sweep (MODE_SWEEP): Steps the current from CUR_MIN to the setpoint in
+   settings.sweep_steps points. Each point lasts settings.sweep_dwell, the
+   voltage is averaged over its second half so the current path's hardware low
+   pass (<8 Hz, ~20 ms) has settled. Each reading is the unfiltered average of
+   one systick, which only adds ~5 ms delay. The sweep ends early when the
+   voltage collapses or the load loses regulation, because the current is
+   unknown from then on. The load is switched off at the end (DISABLE_SWEEP). */
+uint16_t sweep_current = CUR_MIN;
+sweep_point_t sweep_point;
+bool sweep_report = 0;
+uint8_t sweep_end = SWEEP_END_NONE;
+static bool sweep_running = 0;
+static uint8_t sweep_index;
+static uint16_t sweep_ticks;
+static uint32_t sweep_vsum;
+static uint16_t sweep_vcount;
+static bool sweep_unregulated;
+static uint16_t sweep_v_open;
+
+#if F_SYSTICK % 100 != 0
+    #error "sweep_dwell needs F_SYSTICK to be a multiple of 100 Hz"
+#endif
+
+static void sweep_set_point(uint8_t index)
+{
+    sweep_index = index;
+    sweep_current = CUR_MIN + (uint32_t)(settings.setpoints[MODE_SWEEP] - CUR_MIN) *
+        index / (settings.sweep_steps - 1);
+    sweep_ticks = 0;
+    sweep_vsum = 0;
+    sweep_vcount = 0;
+    sweep_unregulated = 0;
+}
+
+static void sweep_stop(uint8_t reason)
+{
+    sweep_running = 0;
+    sweep_current = CUR_MIN;
+    sweep_end = reason;
+}
+
+void sweep_timer()
+{
+    uint16_t voltage = adc_get_voltage();
+    uint16_t dwell = settings.sweep_dwell * (F_SYSTICK / 100);
+
+    if (settings.mode != MODE_SWEEP || !load_active) {
+        if (sweep_running) sweep_stop(SWEEP_END_STOPPED);
+        sweep_v_open = voltage;
+        return;
+    }
+    if (!sweep_running) {
+        sweep_running = 1;
+        sweep_end = SWEEP_END_NONE;
+        sweep_set_point(0);
+    }
+
+    if (++sweep_ticks > dwell / 2) {
+        sweep_vsum += voltage;
+        sweep_vcount++;
+        if (!load_regulated) sweep_unregulated = 1;
+    }
+    if (sweep_ticks < dwell) return;
+
+    if (sweep_unregulated) {
+        sweep_stop(SWEEP_END_UNREGULATED);
+        load_disable(DISABLE_SWEEP);
+        return;
+    }
+    sweep_point.index = sweep_index;
+    sweep_point.current = current_setpoint; // After the power limit
+    sweep_point.voltage = sweep_vsum / sweep_vcount;
+    sweep_point.power = (uint32_t)sweep_point.current * sweep_point.voltage / 1000;
+    sweep_report = 1;
+    if (sweep_point.voltage < (uint32_t)sweep_v_open * SWEEP_COLLAPSE / 100) {
+        sweep_stop(SWEEP_END_COLLAPSE);
+    } else if (sweep_index + 1 >= settings.sweep_steps) {
+        sweep_stop(SWEEP_END_COMPLETE);
+    } else {
+        sweep_set_point(sweep_index + 1);
+        return;
+    }
+    load_disable(DISABLE_SWEEP);
+}
@@ -0,0 +1,30 @@
+#ifndef _SWEEP_H_
+#define _SWEEP_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include "config.h"
+
+typedef enum {
+    SWEEP_END_NONE,
+    SWEEP_END_COMPLETE,    // Reached the setpoint
+    SWEEP_END_COLLAPSE,    // Voltage below SWEEP_COLLAPSE % of the open circuit voltage
+    SWEEP_END_UNREGULATED, // OL_DETECT reported a loss of regulation
+    SWEEP_END_STOPPED,     // Stopped by the user, cutoff or an error
+} sweep_end_t;
+
+typedef struct {
+    uint8_t index;
+    uint16_t current; // mA
+    uint16_t voltage; // mV, average
+    uint32_t power;   // mW
+} sweep_point_t;
+
+/* Current requested from load_update() in MODE_SWEEP */
+extern uint16_t sweep_current;
+extern sweep_point_t sweep_point;
+extern bool sweep_report; // Set for each point, cleared when printed
+extern uint8_t sweep_end; // sweep_end_t of the last sweep, cleared when printed
+
+/* Called every systick from the main loop before load_timer(). */
+void sweep_timer();
+#endif
@@ -1,6 +1,7 @@
 #include "systick.h"
 #include "config.h"
 #include "inc/stm8s_tim2.h"
+#include "inc/stm8s_tim4.h"
 #include "inc/stm8s_itc.h"
 
 volatile uint32_t systick = 0;
@@ -8,14 +9,31 @@ volatile uint8_t systick_flag = 0;
 
 void systick_init()
 {
-    #define SYSTICK_PRESCALER 8
-    #define SYSTICK_RELOAD (F_CPU / F_SYSTICK / SYSTICK_PRESCALER)
     TIM2->PSCR   = TIM2_PRESCALER_8;
     TIM2->ARRH   = SYSTICK_RELOAD >> 8;
     TIM2->ARRL   = SYSTICK_RELOAD & 0xff;
     TIM2->IER    = TIM2_IER_UIE;
     TIM2->CR1    = TIM2_CR1_CEN;
+
+    // TIM4: Free running 1 MHz counter for timestamps, no IRQ.
+    // TIM4->CNTR counts microseconds (8 bit, wraps every 256 us).
+    #if F_CPU != 16000000UL
+    #error "Adjust the TIM4 prescaler"
+    #endif
+    TIM4->PSCR   = TIM4_PRESCALER_16;
+    TIM4->ARR    = 0xff;
+    TIM4->CR1    = TIM4_CR1_CEN;
 }
+
+void systick_timestamp(systick_timestamp_t *t)
+{
+    uint8_t h = TIM2->CNTRH; // Latches CNTRL
+    t->count = ((uint16_t)h << 8) | TIM2->CNTRL;
+    t->tick = systick;
+    // The counter overflowed, but the IRQ didn't run yet
+    if ((TIM2->SR1 & TIM2_SR1_UIF) && t->count < SYSTICK_RELOAD / 2) t->tick++;
+}
+
 //TODO: IRQ priorities
 void systick_irq() __interrupt(ITC_IRQ_TIM2_OVF)
 {
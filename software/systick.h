@@ -1,7 +1,21 @@
 #ifndef _TIMER_H_
 #define _TIMER_H_
 #include <stdint.h>
+#include "config.h"
+
+#define SYSTICK_PRESCALER 8
+#define SYSTICK_RELOAD (F_CPU / F_SYSTICK / SYSTICK_PRESCALER)
+#define SYSTICK_COUNTS_PER_US (F_CPU / SYSTICK_PRESCALER / 1000000)
+
+typedef struct {
+    uint32_t tick;  // systick
+    uint16_t count; // TIM2 counter within the systick, 0..SYSTICK_RELOAD-1
+} systick_timestamp_t;
+
 void systick_init();
+/* Current time with the resolution of TIM2 (0.5 us). Call with interrupts
+   disabled (or from an IRQ). */
+void systick_timestamp(systick_timestamp_t *t);
 extern volatile uint32_t systick;
 #define SYSTICK_COUNT 1
 #define SYSTICK_OVERFLOW 2
@@ -0,0 +1,89 @@
+#include "term.h"
+#include "load.h"
+#include "adc.h"
+
+/* Run termination: Every systick each of settings.term_limits that is set is
+   checked and the load is switched off with its own disable reason
+   (DISABLE_TIME + term_t) when it's reached. Works in all modes.
+   - Time counts from enabling the load.
+   - Charge and energy count from enabling the load as well: the counters
+     (load_charge()/load_energy()) are saved then. If they are cleared while
+     the load runs they count from zero.
+   - Temperature is the heat sink's.
+   - The voltage drop is sampled every TERM_DVDT_INTERVAL. It is only checked
+     once the history is full, so the drop when the load is switched on
+     doesn't count. */
+const uint16_t term_max[NUM_TERM] = {
+    TERM_TIME_MAX, TERM_CHARGE_MAX, TERM_ENERGY_MAX, TERM_TEMPERATURE_MAX, TERM_DVDT_MAX
+};
+uint16_t term_dvdt = 0;
+uint32_t term_seconds = 0;
+bool term_report = 0;
+static bool term_running = 0;
+static uint32_t term_ticks;
+static uint64_t term_charge; // load_charge() when the load was enabled
+static uint64_t term_energy; // load_energy() when the load was enabled
+static uint16_t term_history[TERM_DVDT_SAMPLES]; // Voltage, mV
+static uint8_t term_history_index; // Oldest entry, overwritten next
+static uint8_t term_samples; // Filled history entries
+
+static void term_sample()
+{
+    uint16_t voltage = adc_get_voltage(), old = term_history[term_history_index];
+    if (term_samples == TERM_DVDT_SAMPLES) {
+        term_dvdt = old > voltage ? old - voltage : 0;
+    } else {
+        term_samples++;
+    }
+    term_history[term_history_index] = voltage;
+    if (++term_history_index == TERM_DVDT_SAMPLES) term_history_index = 0;
+}
+
+/* Counter increase since start, start is reset if the counter was cleared */
+static uint64_t term_since(uint64_t counter, uint64_t *start)
+{
+    if (counter < *start) *start = 0;
+    return counter - *start;
+}
+
+static bool term_reached(uint8_t term, uint16_t limit)
+{
+    switch (term) {
+        case TERM_TIME: return term_ticks >= (uint32_t)limit * (36 * F_SYSTICK);
+        case TERM_CHARGE:
+            return term_since(load_charge(), &term_charge) >= (uint64_t)limit * (1000 * CHARGE_PER_UAH);
+        case TERM_ENERGY:
+            return term_since(load_energy(), &term_energy) >= (uint64_t)limit * 10000 * ENERGY_PER_UWH;
+        case TERM_TEMPERATURE: return temperature >= limit;
+        case TERM_DVDT: return term_samples == TERM_DVDT_SAMPLES && term_dvdt >= limit;
+    }
+    return 0;
+}
+
+void term_timer()
+{
+    if (!load_active) {
+        term_running = 0;
+        return;
+    }
+    if (!term_running) {
+        term_running = 1;
+        term_ticks = 0;
+        term_charge = load_charge();
+        term_energy = load_energy();
+        term_samples = 0;
+        term_history_index = 0;
+        term_dvdt = 0;
+    }
+    term_ticks++;
+    if (term_ticks % (TERM_DVDT_INTERVAL * F_SYSTICK) == 0) term_sample();
+    for (uint8_t i = 0; i < NUM_TERM; i++) {
+        uint16_t limit = settings.term_limits[i];
+        if (limit && term_reached(i, limit)) {
+            term_seconds = term_ticks / F_SYSTICK;
+            term_report = 1;
+            load_disable(DISABLE_TIME + i);
+            return;
+        }
+    }
+}
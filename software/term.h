@@ -0,0 +1,16 @@
+#ifndef _TERM_H_
+#define _TERM_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include "config.h"
+#include "settings.h"
+
+/* Upper limits of settings.term_limits */
+extern const uint16_t term_max[NUM_TERM];
+extern uint16_t term_dvdt;    // Voltage drop of the last minute, mV/min
+extern uint32_t term_seconds; // Duration of the run ended by the last limit, s
+extern bool term_report;      // Set when a limit ended the run, cleared when printed
+
+/* Called every systick from the main loop before load_timer(). */
+void term_timer();
+#endif
@@ -0,0 +1,93 @@
+#include "thermal.h"
+#include "load.h"
+#include "adc.h"
+
+/* Thermal model: The sensor measures the heat sink. The MOSFET junction is
+   warmer by P * THERMAL_R_JH, delayed by a first order low pass
+   (THERMAL_TAU_J). The power limit is derated before the OTP trip:
+   - Heat sink: Linear from POW_ABS_MAX at THERMAL_DERATE_START down to 0 at
+     THERMAL_DERATE_END (the load keeps CUR_MIN), so it settles in between
+     instead of tripping at FAN_TEMPERATURE_OTP_LIMIT.
+   - Junction: Linear from POW_ABS_MAX at THERMAL_TJ_DERATE below
+     THERMAL_TJ_MAX down to 0 at THERMAL_TJ_MAX, from the predicted junction
+     temperature thermal_tj. A step of power is derated as the model heats up
+     instead of immediately at its steady state.
+   The time to limit extrapolates the heat sink temperature of the last
+   THERMAL_SLOPE_TIME to the point where derating starts at the present power. */
+uint16_t thermal_tj;
+uint16_t thermal_time = 0xffff;
+uint32_t thermal_power_limit = POW_ABS_MAX;
+static int32_t thermal_rise; // Junction - heat sink, 0.1°C Q8
+static uint16_t thermal_history[THERMAL_SLOPE_TIME]; // Heat sink, once per s
+static uint8_t thermal_history_index;
+static uint8_t thermal_ticks;
+static uint8_t thermal_updates; // Counts THERMAL_RATE updates to one second
+static uint8_t thermal_seconds; // Filled history entries
+
+#if F_SYSTICK % THERMAL_RATE != 0
+    #error "THERMAL_RATE must be an integer divider of F_SYSTICK"
+#endif
+
+/* Linear from POW_ABS_MAX at start down to 0 at end */
+static uint32_t thermal_ramp(uint16_t t, uint16_t start, uint16_t end)
+{
+    if (t >= end) return 0;
+    if (t <= start) return POW_ABS_MAX;
+    return (uint32_t)POW_ABS_MAX * (end - t) / (end - start);
+}
+
+static uint32_t thermal_derate()
+{
+    uint32_t heat_sink = thermal_ramp(temperature, THERMAL_DERATE_START, THERMAL_DERATE_END);
+    uint32_t junction = thermal_ramp(thermal_tj, THERMAL_TJ_MAX - THERMAL_TJ_DERATE, THERMAL_TJ_MAX);
+    return junction < heat_sink ? junction : heat_sink;
+}
+
+static void thermal_trend(uint16_t power_rise)
+{
+    uint16_t old = thermal_history[thermal_history_index];
+    uint16_t limit = THERMAL_DERATE_START;
+    thermal_history[thermal_history_index] = temperature;
+    if (++thermal_history_index == THERMAL_SLOPE_TIME) thermal_history_index = 0;
+    if (thermal_seconds < THERMAL_SLOPE_TIME) {
+        thermal_seconds++; // History not filled yet
+        thermal_time = 0xffff;
+        return;
+    }
+    // Junction derating at the present power (steady state)
+    if (power_rise < THERMAL_TJ_MAX - THERMAL_TJ_DERATE &&
+            THERMAL_TJ_MAX - THERMAL_TJ_DERATE - power_rise < limit) {
+        limit = THERMAL_TJ_MAX - THERMAL_TJ_DERATE - power_rise;
+    }
+    if (temperature >= limit) {
+        thermal_time = 0;
+    } else if (temperature > old) {
+        uint32_t t = (uint32_t)(limit - temperature) * THERMAL_SLOPE_TIME / (temperature - old);
+        thermal_time = t < 0xffff ? t : 0xfffe;
+    } else {
+        thermal_time = 0xffff;
+    }
+}
+
+void thermal_timer()
+{
+    uint32_t power, rise;
+    uint16_t power_rise; // Steady state junction - heat sink, 0.1°C
+    if (++thermal_ticks < F_SYSTICK / THERMAL_RATE) return;
+    thermal_ticks = 0;
+
+    power = (uint32_t)current_setpoint * v_load / 1000; // mW
+    if (GPIOE->ODR & PINE_ENABLE) power = 0; // Load is off
+
+    rise = power * THERMAL_R_JH / 1000;
+    power_rise = rise < 0xffff ? rise : 0xffff;
+    thermal_rise += (((int32_t)power_rise << 8) - thermal_rise) / (THERMAL_TAU_J * THERMAL_RATE);
+    thermal_tj = temperature + (thermal_rise >> 8);
+    thermal_power_limit = thermal_derate();
+    load_set_power_derating(thermal_power_limit);
+
+    if (++thermal_updates == THERMAL_RATE) {
+        thermal_updates = 0;
+        thermal_trend(power_rise);
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef _THERMAL_H_
+#define _THERMAL_H_
+#include <stdint.h>
+#include "config.h"
+
+extern uint16_t thermal_tj;          // Predicted junction temperature, 0.1°C
+extern uint16_t thermal_time;        // s until derating starts, 0xffff = not rising
+extern uint32_t thermal_power_limit; // Derated power limit, mW
+
+/* Called every systick from the main loop before load_timer(). */
+void thermal_timer();
+#endif
@@ -6,6 +6,13 @@
 #include "adc.h"
 #include "load.h"
 #include "ui.h"
+#include "seq.h"
+#include "batt.h"
+#include "sweep.h"
+#include "mppt.h"
+#include "thermal.h"
+#include "term.h"
+#include "ovld.h"
 
 void uart_init()
 {
@@ -46,6 +53,30 @@ static uart_state_t state = STATE_UNINITIALIZED;
 static uint8_t cmd;
 static uint16_t param;
 static uint8_t error_code = 0;
+/* Calibration points: ADC channels first, then the current calibration */
+#define CAL_ADC_POINTS (ADC_NUM_CHANNELS * ADC_CAL_POINTS)
+#define CAL_POINTS (CAL_ADC_POINTS + LOAD_CAL_POINTS)
+static uint8_t cal_point = 0; // Selected calibration point
+static uint8_t cal_report = 0; // Next calibration point to print + 1
+static bool timing_report = 0;
+static uint8_t seq_edit = 0; // Selected sequence step
+static uint8_t seq_report = 0; // Next sequence step to print + 1
+static uint8_t batt_history_report = 0; // Next history entry to print + 1
+static uint8_t term_edit = 0; // Selected termination condition
+
+static void print_batt_result(const batt_result_t *r)
+{
+    printf("%u %lu %u %lu %u %u %u\r\n", r->complete, r->duration, r->mAh, r->mWh,
+        r->voltage, r->resistance, r->current);
+}
+
+/* load_energy() in 512 pJ or load_charge() in 64 nAs as Wh (Ah) with 6
+   decimals. per_micro_hour is ENERGY_PER_UWH or CHARGE_PER_UAH. */
+static void print_micro_hours(uint64_t value, uint32_t per_micro_hour)
+{
+    uint64_t micro = value / per_micro_hour;
+    printf("%lu.%06lu ", (uint32_t)(micro / 1000000), (uint32_t)(micro % 1000000));
+}
 
 static inline void set_error(uint8_t code)
 {
@@ -62,19 +93,37 @@ void uart_handler()
             }
             printf("VAL: %c %d ", status, error);
         } else if (cnt == 2) {
-            printf("T %3u ", temperature);
+            printf("T %3u ", adc_display[ADC_CH_TEMPERATURE]);
         } else if (cnt == 3) {
-            printf("Vi %5u ", v_12V);
+            printf("Vi %5u ", adc_display[ADC_CH_12V]);
         } else if (cnt == 4) {
-            printf("Vl %5u ", v_load);
+            printf("Vl %5u ", adc_display[ADC_CH_LOAD]);
         } else if (cnt == 5) {
-            printf("Vs %5u ", v_sense);
+            printf("Vs %5u ", adc_display[ADC_CH_SENSE]);
         } else if (cnt == 6) {
             printf("I %5u ", current_setpoint);
         } else if (cnt == 7) {
-            printf("mWs %10lu ", mWatt_seconds);
+            printf("mWs %10lu ", load_mWatt_seconds());
         } else if (cnt == 8) {
-            printf("mAs %10lu ", mAmpere_seconds);
+            printf("mAs %10lu ", load_mAmpere_seconds());
+        } else if (cnt == 9) {
+            printf("Vd %5u %c ", v_lead, adc_remote_sense?'R':'L');
+        } else if (cnt == 10) {
+            printf("Sq %2u %5u ", seq_step, seq_time);
+        } else if (cnt == 11) {
+            printf("Wh ");
+            print_micro_hours(load_energy(), ENERGY_PER_UWH);
+        } else if (cnt == 12) {
+            printf("Ah ");
+            print_micro_hours(load_charge(), CHARGE_PER_UAH);
+        } else if (cnt == 13) {
+            printf("Tj %4u ", thermal_tj);
+        } else if (cnt == 14) {
+            printf("Tl %5u ", thermal_time);
+        } else if (cnt == 15) {
+            printf("Pt %6lu ", thermal_power_limit);
+        } else if (cnt == 16) {
+            printf("Ol %5u %8lu ", ovld_events, ovld_unregulated_ms);
         } else {
             printf("\r\n");
             cnt = 0; // Disable output till new trigger by uart_timer()
@@ -83,6 +132,64 @@ void uart_handler()
     } else if (error_code) {
         printf("ERR:%d %d %d\r\n", cmd, param, error_code);
         error_code = 0;
+    } else if (cal_report) {
+        // One line per call to keep the main loop running
+        uint8_t i = cal_report - 1;
+        if (i < CAL_ADC_POINTS) {
+            uint8_t ch = i / ADC_CAL_POINTS;
+            adc_cal_point_t *p = &adc_cal[ch][i % ADC_CAL_POINTS];
+            printf("CAL:%u %u %u %u\r\n", i, p->raw, p->value, adc_values[ch]);
+        } else {
+            load_cal_point_t *p = &load_cal[i - CAL_ADC_POINTS];
+            printf("CAL:%u %u %u %u\r\n", i, p->pwm, p->current, calibration_value);
+        }
+        if (++cal_report > CAL_POINTS) cal_report = 0;
+    } else if (batt_report) {
+        printf("BAT:");
+        print_batt_result(&batt_result);
+        batt_report = 0;
+    } else if (dcir_report) {
+        printf("DCIR:%u %u %u %u %u\r\n", dcir_result.resistance, dcir_result.v_base,
+            dcir_result.v_pulse, dcir_result.i_base, dcir_result.i_pulse);
+        dcir_report = 0;
+    } else if (sweep_report) {
+        printf("IV:%u %u %u %lu\r\n", sweep_point.index, sweep_point.current,
+            sweep_point.voltage, sweep_point.power);
+        sweep_report = 0;
+    } else if (sweep_end) {
+        printf("IVE:%u\r\n", sweep_end);
+        sweep_end = SWEEP_END_NONE;
+    } else if (mppt_report) {
+        printf("MPP:%u %u %lu %u %lu\r\n", mppt_result.current, mppt_result.voltage,
+            mppt_result.power, mppt_result.efficiency, mppt_result.converged);
+        mppt_report = 0;
+    } else if (ovld_report) {
+        printf("OVL:%u %lu %lu %lu\r\n", ovld_events, ovld_dropout.loss, ovld_dropout.regain,
+            ovld_dropout.duration);
+        ovld_report = 0;
+    } else if (term_report) {
+        printf("END:%u %lu\r\n", load_disable_reason, term_seconds);
+        term_report = 0;
+    } else if (batt_history_report) {
+        // Oldest entry first
+        uint8_t i = batt_history_report - 1;
+        uint8_t n = (batt_history.next + i) % BATT_HISTORY;
+        if (batt_history.results[n].duration) {
+            printf("HIS:%u ", i);
+            print_batt_result(&batt_history.results[n]);
+        }
+        if (++batt_history_report > BATT_HISTORY) batt_history_report = 0;
+    } else if (seq_report) {
+        uint8_t i = seq_report - 1;
+        seq_step_t *s = &seq.steps[i];
+        printf("SEQ:%u %u %u %u %u %u\r\n", i, s->duration, s->mode, s->setpoint, s->exit, s->exit_value);
+        if (++seq_report > seq.count) seq_report = 0;
+    } else if (timing_report) {
+        printf("JIT:%u %u %u %u %u %u\r\n",
+            adc_burst_min, adc_burst_max, adc_burst_mean,
+            adc_period_min, adc_period_max, adc_period_mean);
+        adc_timing_reset();
+        timing_report = 0;
     } else if (state == STATE_WAITING_FOR_EXECUTION) {
         printf("CMD:%c%d\r\n", cmd, param);
 
@@ -132,12 +239,294 @@ void uart_handler()
                     set_error(ERR_OUT_OF_RANGE);
                 }
                 break;
+            case 't': // Setpoint transient mode, high level
+                if (param >= CUR_MIN && param <= CUR_MAX) {
+                    settings.setpoints[MODE_TRANSIENT] = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'l': // Transient mode, low level
+                if (param >= CUR_MIN && param <= CUR_MAX) {
+                    settings.transient_low = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'f': // Transient mode, frequency
+                if (param >= TRANSIENT_FREQ_MIN && param <= TRANSIENT_FREQ_MAX) {
+                    settings.transient_freq = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'd': // Transient mode, duty cycle
+                if (param >= TRANSIENT_DUTY_MIN && param <= TRANSIENT_DUTY_MAX) {
+                    settings.transient_duty = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 's': // Slew rate of the current
+                if (param <= RAMP_MAX) {
+                    settings.ramp_rate = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'b': // Setpoint battery test
+                if (param >= CUR_MIN && param <= CUR_MAX) {
+                    settings.setpoints[MODE_BATTERY] = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'u': // Cutoff voltage
+                if (param >= VOLT_MIN && param <= VOLT_MAX) {
+                    settings.cutoff_voltage = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'y': // Battery test: time below the cutoff voltage
+                if (param >= BATT_DEBOUNCE_MIN && param <= BATT_DEBOUNCE_MAX) {
+                    settings.batt_debounce = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'k': // Battery test: compensate the internal resistance
+                if (param) {
+                    settings.flags |= SETTINGS_BATT_COMPENSATION;
+                } else {
+                    settings.flags &= ~SETTINGS_BATT_COMPENSATION;
+                }
+                break;
+            case 'n': // Setpoint DCIR mode, base current
+                if (param >= CUR_MIN && param <= CUR_MAX) {
+                    settings.setpoints[MODE_DCIR] = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'h': // DCIR mode, pulse current
+                if (param >= CUR_MIN && param <= CUR_MAX) {
+                    settings.dcir_pulse = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'o': // DCIR mode, pulse duration
+                if (param >= DCIR_TIME_MIN && param <= DCIR_TIME_MAX) {
+                    settings.dcir_time = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'x': // Setpoint I-V sweep, end current
+                if (param >= CUR_MIN && param <= CUR_MAX) {
+                    settings.setpoints[MODE_SWEEP] = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'g': // I-V sweep, number of points
+                if (param >= SWEEP_STEPS_MIN && param <= SWEEP_STEPS_MAX) {
+                    settings.sweep_steps = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'j': // I-V sweep, time per point
+                if (param >= SWEEP_DWELL_MIN && param <= SWEEP_DWELL_MAX) {
+                    settings.sweep_dwell = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'a': // Setpoint MPPT, maximum current
+                if (param >= CUR_MIN && param <= CUR_MAX) {
+                    settings.setpoints[MODE_MPPT] = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'T': // Select termination condition
+                if (param < NUM_TERM) {
+                    term_edit = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'm': // Limit of the selected termination condition, 0 = off
+                if (param <= term_max[term_edit]) {
+                    settings.term_limits[term_edit] = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'q': // Unregulated time until the overload error, 0 = off
+                if (param <= OVLD_TRIP_MAX) {
+                    settings.ovld_trip = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'p': // CV controller proportional gain
+                if (param <= CV_GAIN_MAX) {
+                    settings.cv_kp = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'i': // CV controller integral gain
+                if (param <= CV_GAIN_MAX) {
+                    settings.cv_ki = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'F': // Outlier filter (bitmask of channels)
+                if (param < (1 << ADC_NUM_CHANNELS)) {
+                    settings.outlier_filter = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'V': // Voltage sense mode
+                if (param <= SENSE_REMOTE) {
+                    settings.sense_mode = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'J': // ADC timing diagnostics
+                timing_report = 1;
+                break;
             case 'E': // Store settings
                 settings_update();
                 break;
             case 'e': // Load settings
                 settings_init();
                 break;
+            case 'P': // Select calibration point
+                if (param < CAL_POINTS) {
+                    cal_point = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'X': // Raw value of calibration point
+                if (load_active) {
+                    set_error(ERR_LOAD_ACTIVE);
+                } else if (cal_point < CAL_ADC_POINTS) {
+                    adc_cal[0][cal_point].raw = param;
+                    adc_cal_apply(); // Might be invalid till all points are set
+                } else {
+                    load_cal[cal_point - CAL_ADC_POINTS].pwm = param;
+                    load_cal_apply();
+                }
+                break;
+            case 'Y': // Calibrated value of calibration point
+                if (load_active) {
+                    set_error(ERR_LOAD_ACTIVE);
+                } else if (cal_point < CAL_ADC_POINTS) {
+                    adc_cal[0][cal_point].value = param;
+                    adc_cal_apply();
+                } else {
+                    load_cal[cal_point - CAL_ADC_POINTS].current = param;
+                    load_cal_apply();
+                }
+                break;
+            case 'C': // Current calibration: raw PWM output, 0 = off
+                calibration_value = param;
+                calibration_step = param ? CAL_CURRENT : CAL_NONE;
+                break;
+            case 'A': // Current calibration: reference current for the PWM output
+                if (calibration_step == CAL_CURRENT && cal_point >= CAL_ADC_POINTS) {
+                    load_cal[cal_point - CAL_ADC_POINTS].pwm = calibration_value;
+                    load_cal[cal_point - CAL_ADC_POINTS].current = param;
+                    load_cal_apply();
+                    if (cal_point < CAL_POINTS - 1) cal_point++;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'I': // Number of sequence steps
+                if (seq_step) {
+                    set_error(ERR_SEQUENCE_INVALID); // Running
+                } else if (param <= SEQ_MAX_STEPS) {
+                    seq.count = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'N': // Select sequence step
+                if (param < SEQ_MAX_STEPS) {
+                    seq_edit = param;
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'D': // Duration of the selected step
+            case 'O': // Mode of the selected step
+            case 'G': // Setpoint of the selected step
+            case 'U': // Exit condition of the selected step
+            case 'L': // Exit value of the selected step
+                // Ranges are checked by seq_valid() on start and store
+                if (seq_step) {
+                    set_error(ERR_SEQUENCE_INVALID); // Running
+                } else if (cmd == 'D') {
+                    seq.steps[seq_edit].duration = param;
+                } else if (cmd == 'O') {
+                    seq.steps[seq_edit].mode = param;
+                } else if (cmd == 'G') {
+                    seq.steps[seq_edit].setpoint = param;
+                } else if (cmd == 'U') {
+                    seq.steps[seq_edit].exit = param;
+                } else {
+                    seq.steps[seq_edit].exit_value = param;
+                }
+                break;
+            case 'H': // Battery test history: 0 = print, 1 = store in flash
+                if (param == 0) {
+                    batt_history_report = 1;
+                } else if (param == 1) {
+                    if (!batt_history_update()) set_error(ERR_LOAD_ACTIVE);
+                } else {
+                    set_error(ERR_OUT_OF_RANGE);
+                }
+                break;
+            case 'Q': // Print sequence
+                if (seq.count) seq_report = 1;
+                break;
+            case 'Z': // Store sequence, the CPU stalls while flash is written
+                if (load_conducting() || !seq_update()) {
+                    set_error(ERR_SEQUENCE_INVALID);
+                }
+                break;
+            case 'B': // Start (1) or stop (0) the sequence
+                if (param && !load_conducting()) {
+                    if (seq_start()) {
+                        ui_activate_load();
+                    } else {
+                        set_error(ERR_SEQUENCE_INVALID);
+                    }
+                } else if (!param && seq_step) {
+                    ui_disable_load();
+                }
+                break;
+            case 'K': // Print calibration
+                cal_report = 1;
+                break;
+            case 'W': // Store calibration
+                if (adc_cal_apply() && load_cal_apply()) {
+                    adc_cal_update();
+                    load_cal_update();
+                } else {
+                    set_error(ERR_CALIBRATION_INVALID);
+                }
+                break;
             default:
                 set_error(ERR_INVALID_COMMAND);
         }
@@ -177,5 +566,4 @@ void uart_rx_irq() __interrupt(ITC_IRQ_UART2_RX)
     } else {
         set_error(ERR_SHOULD_NOT_HAPPEN);
     }
-    //TODO: Calibration mode
 }
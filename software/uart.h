@@ -14,6 +14,9 @@ typedef enum {
     ERR_NOT_A_DIGIT,
     ERR_SHOULD_NOT_HAPPEN, // = Internal logic error
     ERR_INVALID_COMMAND,
+    ERR_CALIBRATION_INVALID,
+    ERR_SEQUENCE_INVALID,
+    ERR_LOAD_ACTIVE,
 } error_codes_t;
 
 #endif
@@ -10,6 +10,9 @@
 #include "inc/stm8s_gpio.h"
 #include "inc/stm8s_itc.h"
 #include "adc.h"
+#include "seq.h"
+#include "batt.h"
+#include "ovld.h"
 
 typedef enum {
     /* Bitmask:
@@ -134,7 +137,7 @@ static void ui_timer_beeper()
 {
     uint8_t timer_value = 0;
     static uint8_t timer = 0;
-    if (load_disable_reason == DISABLE_CUTOFF) {
+    if (load_disable_reason == DISABLE_CUTOFF || load_disable_reason >= DISABLE_TIME) {
         timer_value = F_SYSTICK / F_BEEP_CUTOFF;
     }
     if (error) {
@@ -304,6 +307,7 @@ static uint8_t ui_find_active_subitem(const MenuItem *item)
 {
     uint8_t n = ui_num_subitem(item);
     uint8_t value = *((uint8_t*)item->data);
+    if (item->value) value = (value & item->value) != 0; // Bit of a bitmask
     for (uint8_t i=0; i<n; i++) {
         if (item->subitems[i]->value == value) {
             return i;
@@ -316,7 +320,9 @@ static uint8_t ui_find_active_subitem(const MenuItem *item)
 /** Allows selecting an item in the bottom menu.
     If the child element has an event handler it is called on selection.
     Otherwise the parent's data element is expected to point to a uint8_t
-    variable which is set to the child's data element.
+    variable which is set to the child's data element. If the parent has a
+    value it is a bitmask and only these bits are set (child value != 0) or
+    cleared.
     Very similar to ui_submenu, but selection happens in the bottom menu and no subitem preview is shown (only the caption). */
 void ui_select_item(uint8_t event, const MenuItem *item)
 {
@@ -337,7 +343,13 @@ void ui_select_item(uint8_t event, const MenuItem *item)
         } else {
             /* No handler => just set the value ourselves. */
             uint8_t *p = (uint8_t*)item->data;
-            *p = current_subitem->value;
+            if (!item->value) {
+                *p = current_subitem->value;
+            } else if (current_subitem->value) {
+                *p |= item->value;
+            } else {
+                *p &= ~item->value;
+            }
             ui_pop_item();
         }
     }
@@ -449,6 +461,31 @@ void ui_edit_setpoint(uint8_t event, const MenuItem *item)
             edit = &menu_value_edit_CW;
             label = "WATT";
             break;
+        case MODE_TRANSIENT:
+            edit = &menu_value_edit_TR;
+            label = "IHI ";
+            leds = LED_A;
+            break;
+        case MODE_BATTERY:
+            edit = &menu_value_edit_BAT;
+            label = "AMP ";
+            leds = LED_A;
+            break;
+        case MODE_DCIR:
+            edit = &menu_value_edit_DCIR;
+            label = "IBAS";
+            leds = LED_A;
+            break;
+        case MODE_SWEEP:
+            edit = &menu_value_edit_SWEEP;
+            label = "IMAX";
+            leds = LED_A;
+            break;
+        case MODE_MPPT:
+            edit = &menu_value_edit_MPPT;
+            label = "IMAX";
+            leds = LED_A;
+            break;
         default:
             edit = 0;
             label = "===";
@@ -459,7 +496,9 @@ void ui_edit_setpoint(uint8_t event, const MenuItem *item)
 }
 
 /* Show measured values and setpoint in run mode.
- * Switch automatically between values if user didn't select one. */
+ * Switch automatically between values if user didn't select one.
+ * Battery tests additionally show the internal resistance and the duration,
+ * DCIR mode the resistance of the last pulse. */
 void ui_show_values(uint8_t event)
 {
     static uint16_t switch_timer = 0;
@@ -469,10 +508,15 @@ void ui_show_values(uint8_t event)
         STATE_V,
         STATE_AH,
         STATE_WH,
+        STATE_RI,
+        STATE_TIME,
         STATE_MAX,
     };
     static uint8_t state = STATE_V;
     bool update = false;
+    uint8_t state_max = STATE_RI;
+    if (settings.mode == MODE_BATTERY) state_max = STATE_MAX;
+    if (settings.mode == MODE_DCIR) state_max = STATE_TIME;
 
     if (event == EVENT_ENTER || event == EVENT_RETURN)
     {
@@ -484,19 +528,20 @@ void ui_show_values(uint8_t event)
     if (event == EVENT_ENCODER_UP) {
         manual_mode = true;
         update = true;
-        if (++state == STATE_MAX) state = STATE_V;
+        if (++state >= state_max) state = STATE_V;
     }
 
     if (event == EVENT_ENCODER_DOWN) {
         manual_mode = true;
         update = true;
-        if (state-- == STATE_V) state = STATE_MAX - 1;
+        if (state-- == STATE_V) state = state_max - 1;
     }
 
     if (!manual_mode && (++switch_timer == F_SYSTICK/F_UI_SWITCH_DISPLAY)) {
         switch_timer = 0;
-        if (++state == STATE_MAX) state = STATE_V;
+        if (++state >= state_max) state = STATE_V;
     }
+    if (state >= state_max) state = STATE_V; // Mode changed
 
     if (((event == EVENT_TIMER) && (++update_timer == F_SYSTICK/F_UI_UPDATE_DISPLAY)) ||
          update) {
@@ -504,19 +549,30 @@ void ui_show_values(uint8_t event)
         switch (state) {
             case STATE_V:
                 ui_leds(LED_A|LED_V);
-                ui_number(adc_get_voltage(), VOLT_DOT_OFFSET, DP_TOP);
+                ui_number(adc_get_display_voltage(), VOLT_DOT_OFFSET, DP_TOP);
                 break;
             case STATE_AH:
                 ui_leds(LED_A|LED_AH);
-                ui_number(mAmpere_seconds/3600, AS_DOT_OFFSET, DP_TOP);
+                ui_number(load_mAmpere_seconds()/3600, AS_DOT_OFFSET, DP_TOP);
                 break;
             case STATE_WH:
                 ui_leds(LED_A|LED_WH);
-                ui_number(mWatt_seconds/3600, WS_DOT_OFFSET, DP_TOP);
+                ui_number(load_mWatt_seconds()/3600, WS_DOT_OFFSET, DP_TOP);
+                break;
+            case STATE_RI:
+                ui_leds(0);
+                ui_number(settings.mode == MODE_DCIR ? dcir_result.resistance :
+                    batt_result.resistance, 3, DP_TOP); // Ohm
+                ui_text("RI  ", DP_BOT);
+                break;
+            case STATE_TIME:
+                ui_leds(0);
+                ui_number(batt_result.duration / 60, 4, DP_TOP); // Minutes, no dot
+                ui_text("MIN ", DP_BOT);
                 break;
         }
 
-        ui_number(current_setpoint, CUR_DOT_OFFSET, DP_BOT);
+        if (state < STATE_RI) ui_number(current_setpoint, CUR_DOT_OFFSET, DP_BOT);
 
         /* Blink bottom display if load is unregulated. */
         if (load_regulated) {
@@ -566,6 +622,20 @@ void ui_run_mode(uint8_t event, const MenuItem *item)
     ui_run_info_mode(event);
 }
 
+/* Run the step sequence (see seq.c), otherwise the same as run mode. */
+void ui_sequence_mode(uint8_t event, const MenuItem *item)
+{
+    if (event == EVENT_PREVIEW) {
+        ui_number(seq.count, 3, DP_BOT); // Number of steps
+        return;
+    }
+    if (event == EVENT_ENTER && (load_conducting() || !seq_start())) {
+        ui_pop_item(); // No valid sequence or a soft stop still runs
+        return;
+    }
+    ui_run_mode(event, item);
+}
+
 void ui_info_mode(uint8_t event, const MenuItem *item)
 {
     (void) item; // unused
@@ -591,8 +661,8 @@ void ui_clear_counters(uint8_t event, const MenuItem *item)
         ui_text("DONE", DP_TOP);
         ui_text("   ", DP_BOT);
         timer = 100;
-        mWatt_seconds = 0;
-        mAmpere_seconds = 0;
+        load_clear_counters();
+        ovld_clear();
     }
 
     if (event == EVENT_TIMER) {
@@ -645,9 +715,11 @@ void ui_button_irq() __interrupt(ITC_IRQ_PORTC)
 {
     static uint8_t last_input_values = 0xFF;
 
-    uint8_t input_values = last_input_values & ~GPIOC->IDR; // store changes (H->L) for buttons
+    uint8_t port = GPIOC->IDR;
+    uint8_t input_values = last_input_values & ~port; // store changes (H->L) for buttons
     encoder_pressed |= input_values & PINC_ENC_P;
     run_pressed |= input_values & PINC_RUN_P;
 
-    last_input_values = GPIOC->IDR;
+    last_input_values = port;
+    ovld_irq(port); // OL_DETECT shares the IRQ
 }
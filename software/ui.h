@@ -13,6 +13,7 @@ void ui_select_item(uint8_t event, MenuItem *item);
 void ui_edit_value(uint8_t event, const MenuItem *item);
 void ui_edit_setpoint(uint8_t event, const MenuItem *item);
 void ui_run_mode(uint8_t event, const MenuItem *item);
+void ui_sequence_mode(uint8_t event, const MenuItem *item);
 void ui_info_mode(uint8_t event, const MenuItem *item);
 void ui_error_handler(uint8_t event, const MenuItem *item);
 void ui_clear_counters(uint8_t event, const MenuItem *item);